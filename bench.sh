@@ -0,0 +1,208 @@
+#!/bin/sh
+#--------------------------------------------------
+# 可复现的性能测试: 在合成的Zipf语料上测量word2vec各阶段耗时和训练速度.
+#
+# 完全离线运行: 编译zipf_corpus.c/word2vec.c, 生成固定种子的语料(按参数缓存),
+# 然后依次运行 CBOW/skip-gram x HS/NS 四种配置, 每种配置输出一行JSON:
+#
+#   {"config": {...}, "phases": {"vocab_sec", "phrase_sec", "init_net_sec", "tree_sec", "unigram_sec",
+#    "train_sec", "save_sec"}, "words_per_sec", "words_per_thread_sec", ...}
+#
+# 用法:
+#   ./bench.sh [-words N] [-vocab V] [-threads T] [-size D] [-iter I]
+#              [-work DIR] [-out FILE] [-args "额外的word2vec参数"]
+#              [-check-determinism 1] [-check-phrases T] [-check-monitor N] [-sanitize 1] [-scaling "1 2 4"]
+#              [-thread-scaling "8 16 32 64" [-compare "对比的word2vec参数"]]
+#
+# 结果追加到-out指定的文件(默认bench_results.jsonl), 同时打印到标准输出.
+#
+# -check-determinism 1: 不测速度, 而是每种配置用-deterministic 1训练两次,
+# 比较两次输出的矩阵校验和; 有任何一种不一致则以状态1退出.
+# 用于确认内核优化没有改变计算结果之外的行为(相同代码两次运行必须逐位相同),
+# 也可以对比两个版本的校验和来确认优化是否改变了数学结果.
+#
+# -check-phrases T: 回归测试, 不测速度. 每种配置加上-phrase-threshold T训练一次, 输出选中的短语数;
+# word2vec以非0状态退出(例如-sanitize 1时AddressSanitizer报错)则以状态1退出.
+# 短语统计的词表很快超过初始容量, 能覆盖局部词表扩容的路径.
+#
+# -check-monitor N: 回归测试, 以cbow-ns配置加上-eval-interval N训练一次, 检查stats文件中的monitor_summary:
+# words_per_sec_otherwise必须为正, overhead在[-0.05, 1)内(下限留出计时噪声), 否则以状态1退出.
+#
+# -sanitize 1: 以-g -fsanitize=address编译word2vec, 与-check-phrases/-check-determinism一起使用.
+#
+# -scaling "1 2 4": 不测四种配置, 而是用cbow-ns配置依次以-workers 1, 2, 4个进程
+# (每个进程-threads个线程)训练, 输出每种进程数的速度和扩展效率:
+#   scaling_efficiency = words_per_sec(k) / (k * words_per_sec(第一个进程数) / 第一个进程数)
+#
+# -thread-scaling "8 16 32 64": 用cbow-ns配置依次以各线程数训练, 输出速度和相对第一个线程数的扩展效率;
+# 给出-compare时, 每个线程数再加上-compare中的参数训练一次(variant为"compare"), 用于对比优化前后的扩展性,
+# 例如 -compare "-neg-partitions 16".
+#--------------------------------------------------
+
+set -e
+
+WORDS=10000000
+VOCAB=100000
+THREADS=$(nproc 2>/dev/null || echo 4)
+SIZE=100
+ITER=1
+WORK=/tmp/word2vec_bench
+OUT=bench_results.jsonl
+ARGS=""
+CHECK=0
+CHECK_PHRASES=""
+CHECK_MONITOR=""
+SANITIZE=0
+SCALING=""
+THREAD_SCALING=""
+COMPARE=""
+SRC=$(cd "$(dirname "$0")" && pwd)
+
+while [ $# -gt 0 ]; do
+  case "$1" in
+    -words) WORDS=$2 ;;
+    -vocab) VOCAB=$2 ;;
+    -threads) THREADS=$2 ;;
+    -size) SIZE=$2 ;;
+    -iter) ITER=$2 ;;
+    -work) WORK=$2 ;;
+    -out) OUT=$2 ;;
+    -args) ARGS=$2 ;;
+    -check-determinism) CHECK=$2 ;;
+    -check-phrases) CHECK_PHRASES=$2 ;;
+    -check-monitor) CHECK_MONITOR=$2 ;;
+    -sanitize) SANITIZE=$2 ;;
+    -scaling) SCALING=$2 ;;
+    -thread-scaling) THREAD_SCALING=$2 ;;
+    -compare) COMPARE=$2 ;;
+    *) echo "unknown option $1"; exit 1 ;;
+  esac
+  shift 2
+done
+
+mkdir -p "$WORK"
+
+# 编译.
+CFLAGS="-O3 -march=native -Wall -funroll-loops -Wno-unused-result"
+gcc $CFLAGS "$SRC/zipf_corpus.c" -o "$WORK/zipf_corpus" -lm
+W2V_CFLAGS=$CFLAGS
+if [ "$SANITIZE" = 1 ]; then W2V_CFLAGS="$CFLAGS -g -fsanitize=address"; fi
+gcc $W2V_CFLAGS "$SRC/word2vec.c" -o "$WORK/word2vec" -lm -pthread
+
+# 生成语料(同样的参数只生成一次).
+CORPUS="$WORK/zipf_w${WORDS}_v${VOCAB}.txt"
+if [ ! -f "$CORPUS" ]; then
+  "$WORK/zipf_corpus" -output "$CORPUS" -words "$WORDS" -vocab "$VOCAB"
+fi
+
+# 运行一种配置, 输出一行JSON结果.
+run() {
+  name=$1
+  shift
+  rm -f "$WORK/stats.jsonl"
+  "$WORK/word2vec" -train "$CORPUS" -output "$WORK/vectors.bin" -binary 1 -debug 0 \
+    -threads "$THREADS" -size "$SIZE" -iter "$ITER" -min-count 1 \
+    -stats-file "$WORK/stats.jsonl" -stats-interval 3600 "$@" $ARGS > /dev/null
+  line=$(tail -n 1 "$WORK/stats.jsonl")
+  echo "{\"config\": {\"name\": \"$name\", \"words\": $WORDS, \"vocab\": $VOCAB, \"threads\": $THREADS, \"size\": $SIZE, \"iter\": $ITER, \"args\": \"$* $ARGS\"}, ${line#\{}" | tee -a "$OUT"
+}
+
+# 确定性检查: 同一配置训练两次, 比较校验和.
+FAILED=0
+check() {
+  name=$1
+  shift
+  sum1=$("$WORK/word2vec" -train "$CORPUS" -output "$WORK/vectors.bin" -binary 1 -debug 0 \
+    -threads "$THREADS" -size "$SIZE" -iter "$ITER" -min-count 1 -deterministic 1 "$@" $ARGS | grep Checksums)
+  sum2=$("$WORK/word2vec" -train "$CORPUS" -output "$WORK/vectors.bin" -binary 1 -debug 0 \
+    -threads "$THREADS" -size "$SIZE" -iter "$ITER" -min-count 1 -deterministic 1 "$@" $ARGS | grep Checksums)
+  if [ "$sum1" = "$sum2" ]; then same=true; else same=false; FAILED=1; fi
+  echo "{\"config\": {\"name\": \"$name\", \"words\": $WORDS, \"vocab\": $VOCAB, \"threads\": $THREADS, \"size\": $SIZE, \"iter\": $ITER, \"args\": \"$* $ARGS\"}, \"deterministic\": $same, \"checksums\": \"${sum1#Checksums: }\"}" | tee -a "$OUT"
+}
+
+if [ "$CHECK" = 1 ]; then
+  check cbow-hs -cbow 1 -hs 1 -negative 0
+  check cbow-ns -cbow 1 -hs 0 -negative 5
+  check sg-hs -cbow 0 -hs 1 -negative 0
+  check sg-ns -cbow 0 -hs 0 -negative 5
+  exit $FAILED
+fi
+
+# 短语检测回归测试: 训练必须正常结束, 短语是词表中含'_'的词(合成语料的词只有字母).
+check_phrases() {
+  name=$1
+  shift
+  if "$WORK/word2vec" -train "$CORPUS" -output "$WORK/vectors.bin" -binary 1 -debug 0 \
+    -threads "$THREADS" -size "$SIZE" -iter "$ITER" -min-count 1 -phrase-threshold "$CHECK_PHRASES" \
+    -save-vocab "$WORK/phrase_vocab.txt" "$@" $ARGS > /dev/null; then
+    ok=true
+    n=$(grep -c '_' "$WORK/phrase_vocab.txt" || true)
+  else
+    ok=false; n=0; FAILED=1
+  fi
+  echo "{\"config\": {\"name\": \"$name\", \"words\": $WORDS, \"vocab\": $VOCAB, \"threads\": $THREADS, \"size\": $SIZE, \"iter\": $ITER, \"args\": \"-phrase-threshold $CHECK_PHRASES $* $ARGS\"}, \"ok\": $ok, \"phrases\": $n}" | tee -a "$OUT"
+}
+
+if [ -n "$CHECK_PHRASES" ]; then
+  check_phrases cbow-ns -cbow 1 -hs 0 -negative 5
+  check_phrases sg-hs -cbow 0 -hs 1 -negative 0
+  exit $FAILED
+fi
+
+# 监控线程开销的回归测试.
+if [ -n "$CHECK_MONITOR" ]; then
+  rm -f "$WORK/stats.jsonl"
+  "$WORK/word2vec" -train "$CORPUS" -output "$WORK/vectors.bin" -binary 1 -debug 0 \
+    -threads "$THREADS" -size "$SIZE" -iter "$ITER" -min-count 1 -cbow 1 -hs 0 -negative 5 \
+    -eval-interval "$CHECK_MONITOR" -stats-file "$WORK/stats.jsonl" $ARGS > /dev/null
+  line=$(grep monitor_summary "$WORK/stats.jsonl" || true)
+  rate=$(echo "$line" | sed -n 's/.*"words_per_sec_otherwise": \([-0-9.]*\).*/\1/p')
+  overhead=$(echo "$line" | sed -n 's/.*"overhead": \([-0-9.]*\).*/\1/p')
+  ok=$(awk -v r="$rate" -v o="$overhead" 'BEGIN { print (r != "" && o != "" && r > 0 && o >= -0.05 && o < 1) ? "true" : "false" }')
+  echo "{\"config\": {\"name\": \"cbow-ns\", \"words\": $WORDS, \"vocab\": $VOCAB, \"threads\": $THREADS, \"size\": $SIZE, \"iter\": $ITER, \"args\": \"-eval-interval $CHECK_MONITOR $ARGS\"}, \"ok\": $ok, ${line#\{}" | tee -a "$OUT"
+  if [ "$ok" = true ]; then exit 0; else exit 1; fi
+fi
+
+# 多进程扩展效率: 以第一个进程数的速度为基准.
+if [ -n "$SCALING" ]; then
+  base=""
+  for k in $SCALING; do
+    rm -f "$WORK/stats.jsonl"
+    "$WORK/word2vec" -train "$CORPUS" -output "$WORK/vectors.bin" -binary 1 -debug 0 \
+      -threads "$THREADS" -size "$SIZE" -iter "$ITER" -min-count 1 -cbow 1 -hs 0 -negative 5 \
+      -workers "$k" -stats-file "$WORK/stats.jsonl" $ARGS > /dev/null
+    line=$(tail -n 1 "$WORK/stats.jsonl")
+    wps=$(echo "$line" | sed 's/.*"words_per_sec": \([0-9.]*\).*/\1/')
+    if [ -z "$base" ]; then base=$wps; base_k=$k; fi
+    eff=$(awk -v w="$wps" -v b="$base" -v k="$k" -v bk="$base_k" 'BEGIN { printf "%.4f", w / (b / bk * k) }')
+    echo "{\"config\": {\"name\": \"cbow-ns\", \"words\": $WORDS, \"vocab\": $VOCAB, \"threads\": $THREADS, \"workers\": $k, \"size\": $SIZE, \"iter\": $ITER, \"args\": \"$ARGS\"}, \"scaling_efficiency\": $eff, ${line#\{}" | tee -a "$OUT"
+  done
+  exit 0
+fi
+
+# 多线程扩展效率: 每种variant以第一个线程数的速度为基准.
+if [ -n "$THREAD_SCALING" ]; then
+  for variant in base compare; do
+    if [ $variant = compare ] && [ -z "$COMPARE" ]; then break; fi
+    extra=""
+    if [ $variant = compare ]; then extra=$COMPARE; fi
+    base=""
+    for k in $THREAD_SCALING; do
+      rm -f "$WORK/stats.jsonl"
+      "$WORK/word2vec" -train "$CORPUS" -output "$WORK/vectors.bin" -binary 1 -debug 0 \
+        -threads "$k" -size "$SIZE" -iter "$ITER" -min-count 1 -cbow 1 -hs 0 -negative 5 \
+        -stats-file "$WORK/stats.jsonl" -stats-interval 3600 $ARGS $extra > /dev/null
+      line=$(tail -n 1 "$WORK/stats.jsonl")
+      wps=$(echo "$line" | sed 's/.*"words_per_sec": \([0-9.]*\).*/\1/')
+      if [ -z "$base" ]; then base=$wps; base_k=$k; fi
+      eff=$(awk -v w="$wps" -v b="$base" -v k="$k" -v bk="$base_k" 'BEGIN { printf "%.4f", w / (b / bk * k) }')
+      echo "{\"config\": {\"name\": \"cbow-ns\", \"variant\": \"$variant\", \"words\": $WORDS, \"vocab\": $VOCAB, \"threads\": $k, \"size\": $SIZE, \"iter\": $ITER, \"args\": \"$ARGS $extra\"}, \"scaling_efficiency\": $eff, ${line#\{}" | tee -a "$OUT"
+    done
+  done
+  exit 0
+fi
+
+run cbow-hs -cbow 1 -hs 1 -negative 0
+run cbow-ns -cbow 1 -hs 0 -negative 5
+run sg-hs -cbow 0 -hs 1 -negative 0
+run sg-ns -cbow 0 -hs 0 -negative 5
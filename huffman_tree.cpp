@@ -1,262 +1,282 @@
+//--------------------------------------------------
+// Huffman树构建测试: 在合成的Zipf词汇表上测量huffman_tree.h的构建时间、编码长度与内存,
+// 用于在训练前估计层次softmax(-hs 1)的规模.
+//
+// 代码运行:
+//    g++ -O3 -march=native ./huffman_tree.cpp -o huffman_bench
+//    ./huffman_bench -min-vocab 1000 -max-vocab 50000000
+//
+// 词汇表大小从-min-vocab开始每次乘10, 直到-max-vocab(最后一个为-max-vocab本身).
+// 第r个词(r从1开始)的词频为 min_count * (V / r)^s, 即最低频的词恰好为min_count, 与
+// word2vec按-min-count过滤后的词汇表形状相同.
+//
+// 每种大小输出一行JSON:
+//    build_sec: HuffmanTree()的时间(含编码分配)
+//    max_codelen / avg_codelen: 最大/平均编码长度(每个词)
+//    token_codelen: 按词频加权的平均编码长度, 即每个训练样本HS要更新的syn1行数
+//    tree_bytes: 构建时的临时内存; code_bytes: word2vec为每个词分配的code/point;
+//    syn1_bytes: -size维时syn1的大小
+//    walk: -walk n > 0且syn1不超过-walk-bytes时, 按词频抽取n个词, 模拟HS的前向与更新
+//          (与word2vec.c中TrainHierarchicalSoftmax()相同的访问模式), 比较各内部节点编号方式
+//          (见huffman_tree.h)及是否预取下一行时每个路径节点的耗时(ns_per_step, 两次中较快的一次).
+//--------------------------------------------------
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <memory.h>
-
-#define MAX_CODE_LENGTH 40
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "huffman_tree.h"
 
-long long vocab_max_size = 1000, 
-     vocab_size = 0, 
-     layer1_size = 100;
+long long min_vocab = 1000,
+     max_vocab = 50000000,
+     min_count = 5,
+     layer1_size = 100,
+     walk = 0,                    // 模拟HS的样本数. 0: 不模拟
+     walk_bytes = 1000000000;     // syn1超过walk_bytes时不模拟
 
+double zipf_s = 1.0;
 
 /**
- * word与Huffman树编码
+ * 编码长度的统计.
  */
-struct vocab_word {
-  long long cn;     // 词在训练集中出现的频率
-  int *point;       // 编码的节点路径
-  char *word,       // 词
-       *code,       // Huffman编码，每一位上，0或1
-       codelen;     // Huffman编码长度
+struct code_stats {
+  const long long *count;
+  long long max_len;
+  char *codelen;            // 每个词的编码长度, NULL: 不记录
+  double sum_len,           // ∑ codelen
+       token_len,           // ∑ count * codelen
+       tokens;              // ∑ count
 };
 
-
-struct vocab_word *vocab;
-
 /*
- * 打印构造过程的中间状态.
- */ 
-void printState(long long* count, 
-            long long* binary,
-            long long* parent_node) {
-  printf("count[]:\t");
-  for(int x=0; x<vocab_size * 2; x++) {
-    printf("%lld", count[x]);
-    printf(" ");
-  }
-  printf("\n");
-
-  printf("binary[]:\t");
-  for(int x=0; x<vocab_size * 2; x++) {
-    printf("%lld", binary[x]);
-    printf(" ");
-  }
-  printf("\n");
-
-  printf("parent[]:\t");
-  for(int x=0; x<vocab_size * 2; x++) {
-    printf("%lld", parent_node[x]);
-    printf(" ");
-  }
-  printf("\n");
-
+ * 返回单调时钟的当前时间(秒).
+ */
+double WallTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
+/*
+ * HuffmanTree()的叶子回调: 只统计编码长度.
+ */
+void CountCode(long long word, const char *code, const int *point, int codelen, void *arg) {
+  struct code_stats *cs = (struct code_stats *)arg;
+
+  if (cs->codelen != NULL) cs->codelen[word] = (char)codelen;
+  if (codelen > cs->max_len) cs->max_len = codelen;
+  cs->sum_len += codelen;
+  cs->token_len += (double)cs->count[word] * codelen;
+  cs->tokens += cs->count[word];
+}
 
 /**
- * 使用词频创建一棵的Huffman树. 频率高的字将具有更短的
- * Huffman二进制码(binary code).
- *
+ * 模拟HS时各词的路径: 第w个词的内部节点为point[offset[w], offset[w + 1]).
  */
-// Create binary Huffman tree using the word counts
-// Frequent words will have short uniqe binary codes
-void CreateBinaryTree() {
-  long long a, 
-       b, 
-       i, 
-       min1i, 
-       min2i, 
-       pos1, 
-       pos2, 
-       point[MAX_CODE_LENGTH];
-
-
-  char code[MAX_CODE_LENGTH];
+struct paths {
+  long long *offset;
+  int *point;
+};
 
+/*
+ * HuffmanTree()的叶子回调: 把路径写入struct paths.
+ */
+void StorePath(long long word, const char *code, const int *point, int codelen, void *arg) {
+  struct paths *p = (struct paths *)arg;
+  memcpy(p->point + p->offset[word], point, codelen * sizeof(int));
+}
 
-  // count: 词频.
-  // binary:
-  // parent_node: 
-  long long *count = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-  long long *binary = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-  long long *parent_node = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
+/*
+ * 预取一行到cache, 与word2vec.c中的PrefetchRow()相同.
+ */
+static inline void PrefetchRow(const float *row) {
+  long long c;
+  for (c = 0; c < layer1_size; c += 64 / sizeof(float)) __builtin_prefetch(row + c);
+}
 
-  // 初始化count数组的前一半
-  for (a = 0; a < vocab_size; a++) {
-      count[a] = vocab[a].cn;
-      //printf("count=%lld\n", count[a]);
+/*
+ * 模拟n个HS样本: 对每个词沿路径算出全部logit, 再逐行更新syn1. 返回每个路径节点的耗时(ns).
+ */
+double Walk(struct paths *p, long long *sample, long long n, float *syn1, float *in, float *f, int prefetch) {
+  long long a, c, d, len, *w;
+  int *pt;
+  double t = WallTime(), steps = 0;
+
+  for (a = 0; a < n; a++) {
+    w = sample + a;
+    pt = p->point + p->offset[*w];
+    len = p->offset[*w + 1] - p->offset[*w];
+    for (d = 0; d < len; d++) {
+      if (prefetch && d + 1 < len) PrefetchRow(syn1 + pt[d + 1] * layer1_size);
+      f[d] = 0;
+      for (c = 0; c < layer1_size; c++) f[d] += in[c] * syn1[pt[d] * layer1_size + c];
+    }
+    for (d = 0; d < len; d++) 
+        for (c = 0; c < layer1_size; c++) syn1[pt[d] * layer1_size + c] += 1e-4f * (1 - f[d]) * in[c];
+    steps += len;
   }
+  return (WallTime() - t) * 1e9 / steps;
+}
 
-  // 初始化count数组的后一半，用于交换. 赋很大值.
-  for (a = vocab_size; a < vocab_size * 2; a++) {
-      count[a] = 1e15;
-      //printf("count=%lld\n", count[a]);
+/*
+ * 对n个样本模拟HS, 输出各编号方式与是否预取的耗时(JSON数组的内容).
+ */
+void WalkLayouts(long long v, const long long *count, const char *codelen) {
+  const char *names[3] = {"merge", "bfs", "heavy"};
+  long long a, b, lo, hi, mid, *sample = (long long *)malloc(walk * sizeof(long long));
+  double *cdf = (double *)malloc(v * sizeof(double)), sum = 0, u, t, t2;
+  unsigned long long next_random = 1;
+  float *syn1 = (float *)calloc((v - 1) * layer1_size, sizeof(float)), in[1000], f[HUFFMAN_MAX_CODE_LENGTH];
+  struct paths p;
+  int layout, prefetch, status;
+
+  p.offset = (long long *)malloc((v + 1) * sizeof(long long));
+  p.offset[0] = 0;
+  for (a = 0; a < v; a++) p.offset[a + 1] = p.offset[a] + codelen[a];
+  p.point = (int *)malloc(p.offset[v] * sizeof(int));
+  if (sample == NULL || cdf == NULL || syn1 == NULL || p.point == NULL) {
+    printf("ERROR: cannot allocate the walk for %lld words\n", v);
+    exit(1);
   }
 
-  // 
-  pos1 = vocab_size - 1;
-  pos2 = vocab_size;
-  //printf("pos1=%lld, pos2=%lld\n", pos1, pos2);
-
-  printState(count, binary, parent_node);  
-
-  // 根据算法构建Huffman树，一次增加一个节点.
-  // Following algorithm constructs the Huffman tree by adding one node at a time
-  for (a = 0; a < vocab_size - 1; a++) {
-
-    printf("----------------\n");
-    printf("pos1=%lld, pos2=%lld\n", pos1, pos2);
-
-    // 每轮找到最小的两个值.
-    // First, find two smallest nodes 'min1, min2'
-    if (pos1 >= 0) {
-
-      // 遍历所有词汇的count，比较count；取较小值.
-      if (count[pos1] < count[pos2]) {
-        min1i = pos1;
-        pos1--;
-      } else {
-        min1i = pos2;
-        pos2++;
-      }
-    } else {  
-      min1i = pos2;
-      pos2++;
+  // 按词频抽样(在累积词频上二分查找), 所有配置使用同一组样本.
+  for (a = 0; a < v; a++) cdf[a] = (sum += count[a]);
+  for (a = 0; a < walk; a++) {
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    u = (next_random >> 11) * (1.0 / 9007199254740992.0) * sum;
+    lo = 0; hi = v - 1;
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (cdf[mid] < u) lo = mid + 1; else hi = mid;
     }
-
-    printf("min1i=%d, min2i=%d\n", min1i, min2i);
-    printf("pos1=%lld, pos2=%lld\n", pos1, pos2);
-    // 再比一次.
-    if (pos1 >= 0) {
-      if (count[pos1] < count[pos2]) {
-        min2i = pos1;
-        pos1--;
-      } else {
-        min2i = pos2;
-        pos2++;
-      }
-    } else {
-      min2i = pos2;
-      pos2++;
-    }
-
-    // 最小值cnt的两个索引
-    printf("min1i=%d, min2i=%d\n", min1i, min2i);
-    printf("count[min1i]=%d, count[min2i]=%d\n", count[min1i], count[min2i]);
-
-    count[vocab_size + a] = count[min1i] + count[min2i];
-    parent_node[min1i] = vocab_size + a;
-    parent_node[min2i] = vocab_size + a;
-    binary[min2i] = 1;
-
-    printf("count[vocab_size + a] = %d\n", count[vocab_size + a]);
-    printf("parent_node[%d] = %d\n", min1i, parent_node[min1i]);
-    printf("parent_node[%d] = %d\n", min2i, parent_node[min2i]);
-    printf("binary[%d] = %d\n", min2i, binary[min2i]);
-    
-    printState(count, binary, parent_node);  
-
+    sample[a] = lo;
   }
-
-  // 将二进制编码分配给词汇表中每个词汇.
-  // Now assign binary code to each vocabulary word
-  for (a = 0; a < vocab_size; a++) {
-    b = a;
-    i = 0;
-
-    while (1) {
-      code[i] = binary[b];
-      point[i] = b;
-      i++;
-      b = parent_node[b];
-      if (b == vocab_size * 2 - 2) break;
+  for (a = 0; a < layer1_size && a < 1000; a++) in[a] = (a % 7) * 0.01f;
+
+  // 先写一遍syn1, 使缺页不计入第一种配置的时间.
+  memset(syn1, 0, (v - 1) * layer1_size * sizeof(float));
+
+  b = 0;
+  for (layout = 0; layout < 3; layout++) {
+    status = HuffmanTree(v, count, sizeof(long long), layout, StorePath, &p);
+    if (status != HUFFMAN_OK) {
+      printf("ERROR: HuffmanTree() failed for %lld words with layout %s (%s)\n", v, names[layout],
+             status == HUFFMAN_NO_MEMORY ? "out of memory" : "code too long");
+      exit(1);
     }
-
-    // 得到huffman编码长度.
-    vocab[a].codelen = i;
-
-    // 得到huffman编码code及路径point.
-    vocab[a].point[0] = vocab_size - 2;
-    
-    for (b = 0; b < i; b++) {
-      vocab[a].code[i - b - 1] = code[b];
-      vocab[a].point[i - b] = point[b] - vocab_size;
+    for (prefetch = 0; prefetch < 2; prefetch++) {
+      t = Walk(&p, sample, walk, syn1, in, f, prefetch);
+      t2 = Walk(&p, sample, walk, syn1, in, f, prefetch);
+      printf("%s{\"layout\": \"%s\", \"prefetch\": %d, \"ns_per_step\": %.2f}", b++ ? ", " : "", names[layout], prefetch,
+             t < t2 ? t : t2);
     }
   }
 
-  // 释放内存.
-  free(count);
-  free(binary);
-  free(parent_node);
+  free(sample);
+  free(cdf);
+  free(syn1);
+  free(p.offset);
+  free(p.point);
 }
 
-/**
- * 代码运行：
- * gcc ./huffman_tree.cpp; ./a.out
+/*
+ * 对大小为v的词汇表构建一次Huffman树, 输出一行JSON.
  */
-int main()
-{
-    vocab_size = 6; 
-    vocab = (vocab_word*) calloc(vocab_size, sizeof(vocab_word));
-    memset(vocab, 0, sizeof(vocab_word) * (vocab_size));
-
-    // 初始化code/point.
-    for (int a = 0; a < vocab_size; a++) {
-        vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
-        vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
-    }
-
-    // 事先对vocab按词频排好序(word2vec事先已经用qsort处理)，从大到小排序.
-    // 可以用qsort。 本代码直接已经人工排好序了.
-    vocab[0].cn = 7;
-    char* str = "T";
-    vocab[0].word = str;
-
-    vocab[1].cn = 5;
-    str = "E";
-    vocab[1].word = str;
-
-    vocab[2].cn = 4;
-    str = "G";
-    vocab[2].word = str;
-
-    vocab[3].cn = 4;
-    str = "R";
-    vocab[3].word = str;
-
-    vocab[4].cn = 3;
-    str = "O";
-    vocab[4].word = str;
-
-    vocab[5].cn = 2;
-    str = "F";
-    vocab[5].word = str;
-
+void Bench(long long v) {
+  long long a;
+  long long *count = (long long *)malloc(v * sizeof(long long));
+  struct code_stats cs;
+  double t;
+  int status;
+
+  if (count == NULL) {
+    printf("ERROR: cannot allocate %lld counts\n", v);
+    exit(1);
+  }
+  for (a = 0; a < v; a++) count[a] = llround(min_count * pow((double)v / (a + 1), zipf_s));
+
+  memset(&cs, 0, sizeof(cs));
+  cs.count = count;
+  if (walk > 0) cs.codelen = (char *)malloc(v);
+  t = WallTime();
+  status = HuffmanTree(v, count, sizeof(long long), HUFFMAN_LAYOUT_HEAVY, CountCode, &cs);
+  t = WallTime() - t;
+  if (status != HUFFMAN_OK) {
+    printf("ERROR: HuffmanTree() failed for %lld words (%s)\n", v, status == HUFFMAN_NO_MEMORY ? "out of memory" : "code too long");
+    exit(1);
+  }
 
-    CreateBinaryTree();
+  printf("{\"vocab\": %lld, \"s\": %.2f, \"tokens\": %.0f, \"build_sec\": %.4f, \"max_codelen\": %lld, \"avg_codelen\": %.3f, "
+         "\"token_codelen\": %.3f, \"tree_bytes\": %lld, \"code_bytes\": %lld, \"syn1_bytes\": %lld",
+         v, zipf_s, cs.tokens, t, cs.max_len, cs.sum_len / v, cs.token_len / cs.tokens, HuffmanTreeBytes(v, HUFFMAN_LAYOUT_HEAVY),
+         v * HUFFMAN_MAX_CODE_LENGTH * (long long)(sizeof(char) + sizeof(int)), (v - 1) * layer1_size * (long long)sizeof(float));
+  if (walk > 0 && v > 1 && (v - 1) * layer1_size * (long long)sizeof(float) <= walk_bytes) {
+    printf(", \"walk\": [");
+    WalkLayouts(v, count, cs.codelen);
+    printf("]");
+  }
+  printf("}\n");
+  fflush(stdout);
+  free(cs.codelen);
+  free(count);
+}
 
-    for (int a = 0; a < vocab_size; a++) {
-        printf("word=%s\t", vocab[a].word);
-        printf("cn=%d\t", vocab[a].cn);
-        printf("codelen=%d\t", vocab[a].codelen);
-        
-        printf("code=");
-        for(int i = 0; i < vocab[a].codelen; i++) {
-            printf("%d", vocab[a].code[i]);
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) {
+      if (!strcmp(str, argv[a])) {
+        if (a == argc - 1) {
+            printf("Argument missing for %s\n", str);
+            exit(1);
         }
-        printf("\t");
+        return a;
+      }
+  }
 
-        printf("point=");
-        for(int i = 0; i < vocab[a].codelen; i++) {
-            printf("%d-", vocab[a].point[i]);
-        }
-        
-        printf("\n");
-         //printf("point=%s\n", vocab[a].point);
+  return -1;
+}
 
-    }
+int main(int argc, char **argv) {
+  int i;
+  long long v;
+
+  if (argc == 1) {
+    printf("Huffman tree benchmark on synthetic Zipfian vocabularies\n\n");
+    printf("Options:\n");
+    printf("\t-min-vocab <int>\n");
+    printf("\t\tSmallest vocabulary size; default is 1000\n");
+    printf("\t-max-vocab <int>\n");
+    printf("\t\tLargest vocabulary size (sizes grow by 10x up to it); default is 50000000\n");
+    printf("\t-s <float>\n");
+    printf("\t\tZipf exponent; default is 1.0\n");
+    printf("\t-min-count <int>\n");
+    printf("\t\tCount of the least frequent word; default is 5\n");
+    printf("\t-size <int>\n");
+    printf("\t\tWord vector size used to report the size of syn1; default is 100\n");
+    printf("\t-walk <int>\n");
+    printf("\t\tSimulate <int> hierarchical-softmax examples per vocabulary size and report the time per path node\n");
+    printf("\t\tfor each inner-node layout, with and without prefetching; default is 0 (not simulated)\n");
+    printf("\t-walk-bytes <int>\n");
+    printf("\t\tOnly simulate vocabularies whose syn1 fits in <int> bytes; default is 1000000000\n");
+    printf("\nExamples:\n");
+    printf("./huffman_bench -min-vocab 1000 -max-vocab 50000000\n\n");
+    return 0;
+  }
+
+  if ((i = ArgPos((char *)"-min-vocab", argc, argv)) > 0) min_vocab = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-max-vocab", argc, argv)) > 0) max_vocab = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-s", argc, argv)) > 0) zipf_s = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-size", argc, argv)) > 0) layer1_size = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-walk", argc, argv)) > 0) walk = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-walk-bytes", argc, argv)) > 0) walk_bytes = atoll(argv[i + 1]);
+  if (min_vocab < 1 || layer1_size > 1000 || max_vocab < min_vocab || min_count < 1) {
+    printf("ERROR: invalid arguments\n");
+    return 1;
+  }
 
-    
-    
-	return 0;
+  for (v = min_vocab; v < max_vocab; v *= 10) Bench(v);
+  Bench(max_vocab);
+  return 0;
 }
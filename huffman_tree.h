@@ -0,0 +1,166 @@
+//--------------------------------------------------
+// Huffman树: 层次softmax(HS)中每个词的编码(code)与路径上的内部节点(point).
+//
+// word2vec.c和huffman_tree.cpp(构建速度与规模的测试)共用, C与C++均可包含.
+//
+// 输入为按词频从大到小排好序的n个词频(word2vec在SortVocab()中已排序). 词频可以嵌在
+// 结构体数组中: count指向第0个词的词频, stride为相邻两个词之间的字节数.
+//
+// 构建: 叶子(词频从小到大)和已生成的内部节点(词频本身从小到大)是两个有序队列, 每次从队首取
+// 两个最小的合并, O(n). 构建时第a个内部节点的编号为n + a, 根为n + n - 2.
+// 分配编码: 从根深度优先遍历一次, 一边下降一边记录路径, 到达叶子时调用leaf回调.
+//
+// 内部节点在syn1中的排列(layout): 合并顺序已经按词频从小到大排列, 但一个词路径上相邻的节点
+// 在内存中相距很远. HUFFMAN_LAYOUT_HEAVY按先序遍历编号, 每个节点先访问词频较大的子节点
+// (即编码为1的子节点): 根为0, 沿"重"的一侧向下的节点连续存放, 高频词的路径基本落在连续的行上,
+// 硬件预取和TLB更有效. 节点编号只是syn1的行的一个排列, 训练的数学结果不变.
+//
+// 内存: 内部节点的词频(8字节) + 两个32位子节点编号(8字节) + 新编号(4字节), 即每个词约20字节,
+// 见HuffmanTreeBytes().
+//--------------------------------------------------
+
+#ifndef HUFFMAN_TREE_H
+#define HUFFMAN_TREE_H
+
+#include <stdlib.h>
+#include <string.h>
+
+// 编码的最大长度. point需要HUFFMAN_MAX_CODE_LENGTH个元素(含末尾的叶子自身).
+#define HUFFMAN_MAX_CODE_LENGTH 40
+
+// 内部节点的编号方式(layout).
+#define HUFFMAN_LAYOUT_MERGE 0      // 合并顺序(原word2vec): 第a个生成的内部节点编号为a, 根为n - 2
+#define HUFFMAN_LAYOUT_BFS 1        // 从根开始按层编号, 根为0. 需要额外4n字节的队列
+#define HUFFMAN_LAYOUT_HEAVY 2      // 先序遍历, 先访问词频较大的子节点, 根为0
+
+// HuffmanTree()的返回值.
+#define HUFFMAN_OK 0
+#define HUFFMAN_NO_MEMORY -1        // 内存分配失败
+#define HUFFMAN_TOO_DEEP -2         // 有编码长度 >= HUFFMAN_MAX_CODE_LENGTH
+
+/*
+ * 叶子回调: 词word的编码code[0, codelen)(从根往下, 0或1), 以及路径上的内部节点
+ * point[0, codelen)(从根往下, 内部节点按layout的编号). 与原word2vec一致,
+ * point[codelen]为叶子自身(word - n, 负数, 训练时不使用).
+ */
+typedef void (*huffman_leaf_fn)(long long word, const char *code, const int *point, int codelen, void *arg);
+
+/*
+ * 构建HuffmanTree()所需的临时内存(字节).
+ */
+static inline long long HuffmanTreeBytes(long long n, int layout) {
+  return (n + 1) * (long long)sizeof(long long) + (n * 3 + 3) * (long long)sizeof(int) +
+         (layout == HUFFMAN_LAYOUT_BFS ? n * (long long)sizeof(int) : 0) +
+         (HUFFMAN_MAX_CODE_LENGTH + 2) * 3 * (long long)sizeof(int);
+}
+
+/*
+ * 对n个词构建Huffman树, 内部节点按layout编号, 对每个词调用一次leaf(..., arg). 成功返回HUFFMAN_OK.
+ */
+static inline int HuffmanTree(long long n, const long long *count, size_t stride, int layout, huffman_leaf_fn leaf, void *arg) {
+  long long a, d, min1i, min2i, pos1, pos2, sp, node, next = 0, head, tail;
+  char code[HUFFMAN_MAX_CODE_LENGTH];
+  int point[HUFFMAN_MAX_CODE_LENGTH], status = HUFFMAN_OK;
+
+  // inner_count: 内部节点的词频. 叶子的词频直接读count.
+  // child: 第a个内部节点的两个子节点, child[2a]的编码为0, child[2a + 1]的编码为1.
+  // stack: 深度优先遍历的栈, 每项为(节点, 深度, 该节点的编码位).
+  // renum: 内部节点(构建时的序号)在layout中的编号.
+  long long *inner_count = (long long *)malloc((n + 1) * sizeof(long long));
+  int *child = (int *)malloc((n * 2 + 2) * sizeof(int));
+  int *stack = (int *)malloc((HUFFMAN_MAX_CODE_LENGTH + 2) * 3 * sizeof(int));
+  int *renum = (int *)malloc((n + 1) * sizeof(int)), *queue = NULL;
+
+#define HUFFMAN_LEAF_COUNT(i) (*(const long long *)((const char *)count + (i) * stride))
+#define HUFFMAN_NODE_COUNT(i) ((i) < n ? HUFFMAN_LEAF_COUNT(i) : inner_count[(i) - n])
+
+  if (inner_count == NULL || child == NULL || stack == NULL || renum == NULL) {
+    status = HUFFMAN_NO_MEMORY;
+    goto done;
+  }
+
+  // 一次增加一个内部节点: 比较pos1(叶子队首)与pos2(内部节点队首), 相等时取内部节点.
+  pos1 = n - 1;
+  pos2 = 0;
+  for (a = 0; a < n - 1; a++) {
+    if (pos1 >= 0 && (pos2 >= a || HUFFMAN_LEAF_COUNT(pos1) < inner_count[pos2])) min1i = pos1--;
+    else min1i = n + pos2++;
+    if (pos1 >= 0 && (pos2 >= a || HUFFMAN_LEAF_COUNT(pos1) < inner_count[pos2])) min2i = pos1--;
+    else min2i = n + pos2++;
+
+    inner_count[a] = HUFFMAN_NODE_COUNT(min1i) + HUFFMAN_NODE_COUNT(min2i);
+    child[2 * a] = (int)min1i;
+    child[2 * a + 1] = (int)min2i;
+  }
+
+  // 只有一个词时没有内部节点, 编码长度为0.
+  if (n < 2) {
+    code[0] = 0;
+    for (a = 0; a < n; a++) {
+      point[0] = (int)(a - n);
+      leaf(a, code, point, 0, arg);
+    }
+    goto done;
+  }
+
+  // 合并顺序与按层编号可以预先算出; 先序编号在下面的遍历中按访问顺序分配.
+  if (layout == HUFFMAN_LAYOUT_MERGE) for (a = 0; a < n - 1; a++) renum[a] = a;
+  if (layout == HUFFMAN_LAYOUT_BFS) {
+    queue = (int *)malloc(n * sizeof(int));
+    if (queue == NULL) {status = HUFFMAN_NO_MEMORY; goto done;}
+    queue[0] = n - 2; head = 0; tail = 1;
+    while (head < tail) {
+      a = queue[head];
+      renum[a] = head++;
+      if (child[2 * a] >= n) queue[tail++] = child[2 * a] - n;
+      if (child[2 * a + 1] >= n) queue[tail++] = child[2 * a + 1] - n;
+    }
+  }
+
+  // 从根开始深度优先遍历. 一般先压入编码为1的子节点, 使编码为0的子树先被访问;
+  // HUFFMAN_LAYOUT_HEAVY时反过来, 先访问词频较大(编码为1)的子节点.
+  sp = 0;
+  stack[0] = (int)(n * 2 - 2);
+  stack[1] = 0;
+  stack[2] = 0;
+  sp++;
+  while (sp > 0) {
+    sp--;
+    node = stack[sp * 3];
+    d = stack[sp * 3 + 1];
+    if (d > 0) code[d - 1] = (char)stack[sp * 3 + 2];
+
+    if (node < n) {
+      point[d] = (int)(node - n);
+      leaf(node, code, point, (int)d, arg);
+      continue;
+    }
+
+    if (d + 1 >= HUFFMAN_MAX_CODE_LENGTH) {
+      status = HUFFMAN_TOO_DEEP;
+      goto done;
+    }
+    if (layout == HUFFMAN_LAYOUT_HEAVY) renum[node - n] = next++;
+    point[d] = renum[node - n];
+    for (a = 0; a < 2; a++) {
+      head = (layout == HUFFMAN_LAYOUT_HEAVY) ? a : 1 - a;
+      stack[sp * 3] = child[2 * (node - n) + head];
+      stack[sp * 3 + 1] = (int)(d + 1);
+      stack[sp * 3 + 2] = (int)head;
+      sp++;
+    }
+  }
+
+#undef HUFFMAN_NODE_COUNT
+#undef HUFFMAN_LEAF_COUNT
+
+done:
+  free(inner_count);
+  free(child);
+  free(stack);
+  free(renum);
+  free(queue);
+  return status;
+}
+
+#endif
@@ -0,0 +1,62 @@
+//--------------------------------------------------
+// 可向量化的logistic(sigmoid)函数.
+//
+// word2vec原来用1000格的expTable查表计算sigmoid: 每次需要一次float->int
+// 转换和一次随机读(gather), 以及对(-MAX_EXP, MAX_EXP)的分支判断,
+// 使得批量计算无法向量化. 这里改用有理函数近似, 没有查表和分支:
+//
+//    sigmoid(x) = 0.5 + 0.5 * tanh(x / 2)
+//    tanh(h) ≈ h * P(h^2) / Q(h^2),   |h| <= 7.905 (超出后tanh在float精度下为±1)
+//
+// P为6阶、Q为3阶多项式(系数取自Eigen的ptanh_float), 最大绝对误差约2e-7,
+// 远好于expTable(步长0.012, 误差可达9e-3).
+//
+// 截断用三目运算而不用fminf/fmaxf: 后者在未开-ffast-math时会阻止向量化.
+// 编译器开启-O3后, SigmoidBatch()的循环可以自动向量化(SSE/AVX).
+//--------------------------------------------------
+
+#ifndef SIGMOID_H
+#define SIGMOID_H
+
+// tanh的有理近似在|h| <= SIGMOID_MAX_H内有效.
+#define SIGMOID_MAX_H 7.90531110763549805f
+
+/*
+ * 计算一个sigmoid值.
+ */
+static inline float FastSigmoid(float x) {
+  float h = 0.5f * x, h2, p, q;
+
+  // 截断到[-SIGMOID_MAX_H, SIGMOID_MAX_H].
+  h = (h < -SIGMOID_MAX_H) ? -SIGMOID_MAX_H : h;
+  h = (h > SIGMOID_MAX_H) ? SIGMOID_MAX_H : h;
+  h2 = h * h;
+
+  // 分子: h * P(h^2)
+  p = -2.76076847742355e-16f;
+  p = p * h2 + 2.00018790482477e-13f;
+  p = p * h2 - 8.60467152213735e-11f;
+  p = p * h2 + 5.12229709037114e-08f;
+  p = p * h2 + 1.48572235717979e-05f;
+  p = p * h2 + 6.37261928875436e-04f;
+  p = p * h2 + 4.89352455891786e-03f;
+  p = p * h;
+
+  // 分母: Q(h^2)
+  q = 1.19825839466702e-06f;
+  q = q * h2 + 1.18534705686654e-04f;
+  q = q * h2 + 2.26843463243900e-03f;
+  q = q * h2 + 4.89352518554385e-03f;
+
+  return 0.5f + 0.5f * p / q;
+}
+
+/*
+ * 批量计算sigmoid: p[i] = sigmoid(x[i]), i ∈ [0, n).
+ */
+static inline void SigmoidBatch(const float *x, float *p, long long n) {
+  long long i;
+  for (i = 0; i < n; i++) p[i] = FastSigmoid(x[i]);
+}
+
+#endif
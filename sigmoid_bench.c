@@ -0,0 +1,121 @@
+//--------------------------------------------------
+// sigmoid精度与速度对比: word2vec原来的expTable查表 vs sigmoid.h多项式近似.
+//
+// 代码运行:
+//    gcc -O3 -march=native ./sigmoid_bench.c -o sigmoid_bench -lm; ./sigmoid_bench
+//
+// 输出一行JSON:
+//    精度: 在[-RANGE, RANGE]上均匀取点, 与double精度的sigmoid比较, 最大/平均绝对误差.
+//    速度: 对batch个随机logit反复批量计算, 每个元素的平均耗时(ns).
+//          batch取6(negative=5时每步的logit数), 20(HS路径的典型长度)和64.
+//--------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "sigmoid.h"
+
+#define EXP_TABLE_SIZE 1000
+#define MAX_EXP 6
+#define RANGE 8.0
+#define POINTS 10000000
+#define MAX_BATCH 64
+#define ELEMS 100000000   // 每种batch计算的总元素数
+
+float *expTable;
+
+/*
+ * word2vec原来的查表方法: 超出(-MAX_EXP, MAX_EXP)的部分取0或1.
+ */
+void TableBatch(const float *f, float *p, long long n) {
+  long long d;
+  for (d = 0; d < n; d++) {
+    if (f[d] > MAX_EXP) p[d] = 1;
+    else if (f[d] < -MAX_EXP) p[d] = 0;
+    else p[d] = expTable[(int)((f[d] + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
+  }
+}
+
+void PolyBatch(const float *f, float *p, long long n) {
+  SigmoidBatch(f, p, n);
+}
+
+double WallTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * 精度: 最大绝对误差与平均绝对误差.
+ */
+void Accuracy(void (*fn)(const float *, float *, long long), double *max_err, double *avg_err) {
+  long long i;
+  float x, p;
+  double e;
+
+  *max_err = 0;
+  *avg_err = 0;
+  for (i = 0; i < POINTS; i++) {
+    x = -RANGE + 2 * RANGE * i / (POINTS - 1);
+    fn(&x, &p, 1);
+    e = fabs(p - 1 / (1 + exp(-(double)x)));
+    if (e > *max_err) *max_err = e;
+    *avg_err += e;
+  }
+  *avg_err /= POINTS;
+}
+
+/*
+ * 速度: 每个元素的平均耗时(ns). 每轮换一组输入, 避免编译器把循环外提.
+ */
+double Speed(void (*fn)(const float *, float *, long long), float *in, float *out, long long batch) {
+  long long r, rounds = ELEMS / batch;
+  double t = WallTime(), sum = 0;
+
+  for (r = 0; r < rounds; r++) {
+    fn(in + (r & 1023) * batch, out, batch);
+    sum += out[r % batch];
+  }
+  t = WallTime() - t;
+  if (sum < 0) printf("%f\n", sum);
+  return t * 1e9 / ((double)rounds * batch);
+}
+
+int main() {
+  long long i, b, batch[3] = {6, 20, 64};
+  unsigned long long next_random = 1;
+  double table_max, table_avg, poly_max, poly_avg;
+  float *in = (float *)malloc(1024 * MAX_BATCH * sizeof(float));
+  float out[MAX_BATCH];
+
+  // 与word2vec.c中main()相同的初始化.
+  expTable = (float *)malloc((EXP_TABLE_SIZE + 1) * sizeof(float));
+  for (i = 0; i < EXP_TABLE_SIZE; i++) {
+    expTable[i] = exp((i / (float)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP);
+    expTable[i] = expTable[i] / (expTable[i] + 1);
+  }
+
+  // 随机logit: 均匀分布在[-RANGE, RANGE].
+  for (i = 0; i < 1024 * MAX_BATCH; i++) {
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    in[i] = ((next_random >> 16) & 0xFFFF) / 65536.0 * 2 * RANGE - RANGE;
+  }
+
+  Accuracy(TableBatch, &table_max, &table_avg);
+  Accuracy(PolyBatch, &poly_max, &poly_avg);
+
+  printf("{\"range\": %.1f, \"table\": {\"max_abs_err\": %.3e, \"avg_abs_err\": %.3e}, "
+         "\"poly\": {\"max_abs_err\": %.3e, \"avg_abs_err\": %.3e}, \"speed\": [",
+         RANGE, table_max, table_avg, poly_max, poly_avg);
+  for (b = 0; b < 3; b++) {
+    printf("%s{\"batch\": %lld, \"table_ns_per_elem\": %.3f, \"poly_ns_per_elem\": %.3f}", b ? ", " : "",
+           batch[b], Speed(TableBatch, in, out, batch[b]), Speed(PolyBatch, in, out, batch[b]));
+  }
+  printf("]}\n");
+
+  free(in);
+  free(expTable);
+  return 0;
+}
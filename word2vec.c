@@ -25,16 +25,37 @@
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "sigmoid.h"
+#include "huffman_tree.h"
 
 #define MAX_STRING 100
+#define MAX_PATH_STRING 4096
 #define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
 #define MAX_SENTENCE_LENGTH 1000
-#define MAX_CODE_LENGTH 40
-
-const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
+#define MAX_CODE_LENGTH HUFFMAN_MAX_CODE_LENGTH
+#define QUEUE_SIZE 16
+#define EVAL_BATCH 32
+#define MONITOR_WORDS 5000
+#define MONITOR_QUESTIONS 1000
+#define SKETCH_DEPTH 4
+#define MAX_VOCAB_ROWS 0x7fffffffLL
+#define VOCAB_CACHE_VERSION 1
+#define FINGERPRINT_SAMPLES 16
+#define FINGERPRINT_BLOCK 4096
 
 typedef float real;                    // Precision of float numbers
+typedef unsigned short bf16;           // bfloat16: float的高16位, 用于-bf16时syn0/syn1neg的存储
 
 
 /**
@@ -48,25 +69,165 @@ struct vocab_word {
        codelen;     // Huffman编码长度
 };
 
-char train_file[MAX_STRING], 
+char train_file[MAX_PATH_STRING], 
      output_file[MAX_STRING];
 
 char save_vocab_file[MAX_STRING], 
-     read_vocab_file[MAX_STRING];
+     read_vocab_file[MAX_STRING],
+     stats_file[MAX_STRING];
+
+// 评测: 类比问题文件, 词相似度文件, 以及只评测不训练时读取的词向量文件.
+char eval_analogy_file[MAX_PATH_STRING],
+     eval_similarity_file[MAX_PATH_STRING],
+     read_vectors_file[MAX_PATH_STRING];
 
 struct vocab_word *vocab;
 
+/**
+ * 语料文件. 训练语料可以由多个文件组成, 所有文件按顺序首尾相接,
+ * 看成一个虚拟的字节流; offset为该文件在字节流中的起始位置.
+ */
+struct corpus_file {
+  char *name;           // 文件路径
+  long long size,       // 文件字节数
+       offset;          // 在虚拟字节流中的起始偏移
+};
+
+/**
+ * 语料读取器: 读取虚拟字节流上的一个字节区间[start, end), 区间可以跨越多个文件.
+ */
+struct corpus_reader {
+  FILE *fin;            // 当前打开的文件
+  int file;             // 当前文件在corpus_files中的下标
+  long long start,      // 区间起点(虚拟字节流上的偏移)
+       end;             // 区间终点
+  int eof;              // 区间是否已读完
+  char pending[MAX_STRING];   // 合并短语时预读的下一个词. 空串: 没有
+  int pending_eof;      // 预读时区间已读完
+};
+
+/**
+ * 句子批次: 读取线程完成分词、查词表和subsampling后的一个句子.
+ */
+struct sentence_batch {
+  long long sen[MAX_SENTENCE_LENGTH + 1];   // 词在vocab中的索引
+  long long length,         // 句子长度
+       word_count;          // 读取的词数(含被subsampling丢弃的词)
+  int end_of_shard;         // 分片已读完, 本轮迭代结束
+};
+
+/**
+ * 读取线程 -> 训练线程的单生产者单消费者(SPSC)无锁环形队列.
+ * head只由消费者写, tail只由生产者写, 两者放在不同的cache line上.
+ */
+struct sentence_queue {
+  struct sentence_batch batch[QUEUE_SIZE];
+  long long head;           // 消费者下一个要取的位置
+  char pad1[64];
+  long long tail;           // 生产者下一个要写的位置
+  char pad2[64];
+  double empty_wait,        // 消费者等待队列非空的时间(秒)
+       full_wait;           // 生产者等待队列非满的时间(秒)
+};
+
+/**
+ * 训练线程的统计计数器. 每个线程只写自己的一份, 统计线程定期读取汇总.
+ * 末尾的pad保证相邻线程的计数器不在同一个cache line上.
+ */
+struct thread_stats {
+  long long words_read,     // 读取的词数(含被subsampling丢弃的词)
+       words_kept,          // subsampling后保留的词数
+       sentences,           // 句子数
+       hs_steps,            // HS计算的路径节点数
+       hs_skipped,          // HS中|f| >= MAX_EXP而跳过更新的节点数
+       neg_samples,         // 负样本数
+       neg_skipped,         // 抽到中心词本身而跳过的负样本数
+       loss_examples,       // 计入损失的样本数: CBOW每个中心词一个, skip-gram每个(中心词, 上下文词)一个
+       merges;              // -replicate-rows: 行副本合并到共享矩阵的次数
+  double loss;              // 累计的训练损失: 每个样本HS/NS的-log(sigmoid)之和
+  double read_time,         // 读取语料(流水线模式: 等待队列)的时间(秒)
+       compute_time;        // 训练的时间(秒)
+  int done;                 // 线程已结束
+  char pad[64];
+};
+
+/**
+ * 训练线程的工作区: 批量计算HS/NS的logit时用到的临时数组,
+ * 长度为max(negative + 1, MAX_CODE_LENGTH).
+ */
+struct thread_scratch {
+  long long *target;        // NS: 正样本与负样本的词索引; HS: 路径上的内部节点
+  real *f,                  // logit: 输入向量与输出向量的点积
+       *p,                  // sigmoid(f)
+       *g,                  // 梯度 * 学习率
+       *hot_acc;            // -neg-partitions: 前hot_rows行syn1neg的本线程累积更新, NULL: 不累积
+  int *hot_pending;         // 有累积更新的热点行
+  char *hot_used;           // 热点行是否在hot_pending中
+  long long hot_n;          // hot_pending中的行数
+  real *rep,                // -replicate-rows: 前rep_rows行syn0(以及syn1neg)的本线程副本
+       *rep_base;           // 上次合并后副本的值, 用于计算本线程的增量
+  long long rep_rows,       // 副本的行数. 0: 不使用副本
+       rep_merged;          // 上次合并时本线程读取的词数
+  unsigned long long round_random;  // -bf16: 随机舍入的随机数
+  struct thread_stats *stats;   // 本线程的统计计数器
+};
+
+/**
+ * 各阶段的耗时(秒). 训练结束后输出, 用于性能测试.
+ */
+struct phase_times {
+  double vocab,             // 生成(或读取)词汇表
+       phrase,              // 其中LearnPhrases()的时间
+       init_net,            // InitNet(), 含Huffman树
+       tree,                // 其中CreateBinaryTree()的时间
+       unigram,             // InitUnigramTable()
+       train,               // 多线程训练
+       save;                // 保存结果
+};
+
+struct corpus_file *corpus_files;
+int num_corpus_files = 0;
+struct sentence_queue *queues;
+struct thread_stats *stats;
+struct phase_times phases;
+
+// 统计线程与监控线程的停止标志.
+int stats_stop = 0;
+
+// stats_file在训练期间由统计线程和监控线程共同写入.
+FILE *stats_fo = NULL;
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// 确定性训练: 训练线程按id轮流处理句子, turn为当前轮到的线程.
+pthread_mutex_t turn_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t turn_cond = PTHREAD_COND_INITIALIZER;
+long long turn = 0;
+char *turn_active;
+
 // 
 int binary = 0, 
     cbow = 1, 
     debug_mode = 2, 
     window = 5, 
     min_count = 5, 
-    num_threads = 12, 
-    min_reduce = 1;     // min_reduce 
+    num_threads = 12;
 
-// 
-int *vocab_hash;
+// 词汇表的hash表: 开放寻址, 容量为2的幂, 存放词在vocab中的下标(-1: 空).
+// 装载率超过0.7时容量翻倍, 见GrowVocabHash(); 词汇表的大小没有上限.
+long long *vocab_hash,
+     vocab_hash_size = 0;
+int vocab_hash_bits = 0;
+
+// 词频的count-min sketch: -count-sketch > 0时先用它近似统计一遍语料(只会高估),
+// 第二遍只对估计值 >= min_count的词精确计数, 长尾的低频词不进入词表, 内存有界.
+// 短语: -phrase-threshold > 0时先检测短语(得分高的相邻词对), 读取语料时合并为一个词"a_b".
+real phrase_threshold = 0;          // 短语得分的阈值. 0: 不检测短语
+long long phrase_min_count = 5,     // 短语及其两个词的最小词频
+     phrase_max_bigrams = 20000000; // 统计时保留的bigram个数的上限(所有线程合计)
+
+long long count_sketch = 0;         // 每个统计线程的sketch大小(MB). 0: 不使用, 直接精确计数
+unsigned int *vocab_sketch = NULL;  // 合并后的sketch, SKETCH_DEPTH行, 每行2^sketch_bits个计数
+int sketch_bits = 0;
 
 // 
 long long vocab_max_size = 1000,    // 
@@ -78,7 +239,9 @@ long long train_words = 0,
      word_count_actual = 0,
      iter = 5,                  // 缺省配置. 迭代次数.
      file_size = 0, 
-     classes = 0;
+     classes = 0,
+     eval_top = 30000,          // 类比评测只在词频最高的eval_top个词中搜索答案
+     eval_interval = 0;         // 训练中每读取eval_interval个词评测一次. 0: 不评测
 
 // 学习率.
 real alpha = 0.025,         // 学习率. 缺省:0.025 
@@ -89,19 +252,112 @@ real alpha = 0.025,         // 学习率. 缺省:0.025
 real *syn0,         // input -> hidden 的 weights，大小：vocab_size * layer1_size 
      *syn1,         // hidden->output 的 weights，大小：vocab_size * layer1_size 
      *syn1neg,      // 
-     *expTable;
-
-// 
-clock_t start;
+     *expTable,
+     *logSigTable;  // -log(sigmoid(x))表, 与expTable的取值点相同, 用于统计训练损失
+
+// 训练开始的时间(单调时钟, 秒).
+double start;
+
+// 进度行上次打印时的累计损失与样本数. 与word_count_actual一样由各线程无锁更新, 只用于显示.
+double progress_loss = 0;
+long long progress_examples = 0;
+
+// 提前停止: 每过一轮比较这一轮与上一轮的平均损失, 相对下降小于early_stop时,
+// 学习率从当前值在最后一轮(train_words个词)内线性降到0, 然后停止训练.
+real early_stop = 0,        // 损失相对下降的阈值. 0: 不提前停止
+     stop_alpha;            // 进入最后一轮时的学习率
+pthread_mutex_t epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+long long loss_epoch = 0,   // 已统计损失的轮数
+     stop_start = 0,        // 进入最后一轮时的word_count_actual
+     stop_words = 0;        // word_count_actual达到stop_words时停止. 0: 按iter训练
+double epoch_loss = 0,      // 上一轮的平均损失
+     epoch_loss_prev = 0;   // 上一轮结束时的累计损失, 用于IntervalLoss()
+long long epoch_examples_prev = 0;
+int stop_training = 0;      // 训练线程和读取线程的停止标志
+
+// 分布式训练: 协调进程fork出num_workers个工作进程, 通过Unix套接字定期做参数平均.
+int num_workers = 0,        // 工作进程数. 0或1: 不使用分布式训练
+    worker_id = 0,          // 工作进程的序号, 决定它训练哪一份语料
+    dist_fd = -1,           // 工作进程: 与协调进程的连接. -1: 不是工作进程
+    *dist_fds;              // 协调进程: 与各工作进程的连接
+pid_t *dist_pids;
+long long sync_words = 1000000,     // 工作进程每读取sync_words个词同步一次
+     dist_size = 0,                 // 同步的参数个数(所有同步矩阵)
+     dist_words = 0;                // 协调进程: 所有工作进程读取的词数
+real *dist_base,                    // 工作进程: 上一次同步后的全局模型
+     *dist_mats[3],                 // 同步的矩阵, 见SyncMatrices()
+     *dist_delta,                   // 打包的行增量
+     *dist_mean;                    // 打包的平均行增量
+unsigned int *dist_stamps[3],       // 同步矩阵的行stamp
+     dist_since;                    // 工作进程: 上次同步时的epoch
+int dist_k,                         // 同步矩阵的个数
+    *dist_rows,                     // 每个同步矩阵的行号列表(发送/接收的行)
+    *dist_union,                    // 每个同步矩阵的行号列表(平均增量的行)
+    *dist_pos;                      // 行号 -> 本进程发送的增量序号, -1: 未发送
+
+// syn1neg的行按行号 % neg_partitions分区, 每个分区一把锁. 高频词(前hot_rows行)的更新先累积在
+// 训练线程自己的缓冲区中, 每个句子结束时按分区加锁合并, 避免所有线程频繁写同一批cache line.
+int neg_partitions = 0;             // 分区数. 0: 不使用, 所有行都直接无锁更新
+long long hot_rows = 1024;          // 累积更新的高频行数
+pthread_mutex_t *neg_locks;
+
+// 半精度存储: -bf16时syn0/syn1neg在训练期间以bf16保存(syn0/syn1neg为NULL), 内存减半.
+// 计算(neu1/neu1e/logit)仍为float, 写回时随机舍入; 训练结束后转换回float.
+int bf16_storage = 0;
+bf16 *syn0_bf = NULL,
+     *syn1neg_bf = NULL;
+
+// 高频行副本: 前replicate_rows个词的syn0/syn1neg行几乎出现在每个窗口中, 各线程在私有副本上更新,
+// 每读取replicate_words个词把副本的增量加到共享矩阵, 再从共享矩阵刷新副本.
+long long replicate_rows = 0,       // 副本的行数. 0: 不使用副本
+     replicate_words = 10000;       // 每个线程每读取replicate_words个词合并一次
+
+// 行的脏标记: syn0/syn1/syn1neg每行最后一次被更新时的epoch, 见MarkDirty(). NULL: 不跟踪.
+unsigned int *syn0_stamp = NULL,
+     *syn1_stamp = NULL,
+     *syn1neg_stamp = NULL,
+     dirty_epoch = 1;
+
+// 子词(字符n-gram, fastText): -subword-buckets > 0时, 词的输入向量为自身行与其字符n-gram行的平均.
+// n-gram按hash映射到subword_buckets行, 存放在syn0的第vocab_size行之后; 词表外的词也能由n-gram得到向量.
+long long subword_buckets = 0;      // n-gram的bucket数. 0: 不使用子词
+int subword_minn = 3,               // n-gram的最小长度(字符)
+    subword_maxn = 6;               // n-gram的最大长度(字符)
+long long *subword_offset = NULL;   // 词w的输入行为subword_rows[subword_offset[w], subword_offset[w + 1])
+int *subword_rows = NULL;           // 输入行在syn0中的行号, 第一项为词自身. 各词的列表连续存放
+char save_subwords_file[MAX_PATH_STRING],
+     read_subwords_file[MAX_PATH_STRING],
+     query_file[MAX_PATH_STRING];   // 只查询词向量(含词表外的词)时, 每行一个词
+
+// 词汇表缓存: 以语料指纹为键的二进制文件, 保存排序后的词汇表及其hash表, 以及已经建好的
+// Huffman编码和unigram表. 指纹相同时直接mmap读取, 不再统计语料. 见LoadVocabCache().
+char vocab_cache_file[MAX_PATH_STRING];
+int vocab_cache_codes = 0,          // Huffman编码来自缓存, 不再调用CreateBinaryTree()
+    vocab_cache_table = 0,          // unigram表来自缓存, 不再调用InitUnigramTable()
+    vocab_cache_save = 0;           // 缓存缺失或不完整, 准备好之后重新保存
+
+// 增量checkpoint: 每读取checkpoint_words个词, 把上次之后被更新过的行追加到checkpoint_file.
+char checkpoint_file[MAX_PATH_STRING];
+long long checkpoint_words = 10000000;
 
 // 默认配置.
 int hs = 0, 
-    negative = 5;
+    negative = 5,
+    num_readers = 0,        // 读取线程数. 0: 每个训练线程自己读取语料
+    exp_table = 0,          // 1: 使用原来的expTable查表计算sigmoid
+    stats_interval = 10,    // 统计信息的输出间隔(秒)
+    deterministic = 0,      // 1: 确定性训练, 结果逐位可复现(线程数相同时)
+    vocab_binary = 0,       // 1: -save-vocab保存为二进制格式(-read-vocab自动识别)
+    prefetch = 1,           // 1: 预取HS路径的下一行、NS的目标行和下一个窗口新进入的上下文行
+    hs_layout = HUFFMAN_LAYOUT_HEAVY;   // syn1中内部节点的排列, 见huffman_tree.h
 
 // 1-gram table.
 const int table_size = 1e8;
 int *table;
 
+// subsampling: 每个词的保留阈值, 与随机数的低16位比较.
+unsigned int *keep_threshold;
+
 
 /**
  * unigram/1-gram: 每个单词的cn^pow表，负样本抽样中用到
@@ -162,6 +418,24 @@ void InitUnigramTable() {
   }
 }
 
+/**
+ * subsampling保留阈值表: 每个词的保留概率只与词频有关, 训练前一次算好.
+ *
+ * 保留概率: ran = (sqrt(cn / (sample * train_words)) + 1) * (sample * train_words) / cn
+ * 原始判断: ran >= (next_random & 0xFFFF) / 65536 时保留
+ * 等价于:   (next_random & 0xFFFF) < floor(ran * 65536) + 1, 阈值上限为65536(总是保留).
+ */
+void InitKeepThreshold() {
+  long long a;
+  double ran, t = sample * train_words;
+
+  keep_threshold = (unsigned int *)malloc(vocab_size * sizeof(unsigned int));
+  for (a = 0; a < vocab_size; a++) {
+    ran = (sqrt(vocab[a].cn / t) + 1) * t / vocab[a].cn;
+    keep_threshold[a] = (ran >= 1) ? 65536 : (unsigned int)(ran * 65536) + 1;
+  }
+}
+
 /**
  * 从文件中文件指针处，读取一个word.
  */
@@ -205,26 +479,444 @@ void ReadWord(char *word, FILE *fin) {
 }
 
 /*
- * 计算一个32位的hash值
+ * 添加一个语料文件. 只接受普通文件, 空文件忽略.
  */
-// Returns hash value of a word
-int GetWordHash(char *word) {
-  unsigned long long a, hash = 0;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
+void AddCorpusFile(char *name) {
+  struct stat st;
+  if (stat(name, &st) != 0 || !S_ISREG(st.st_mode)) {
+    printf("ERROR: training data file %s not found!\n", name);
+    exit(1);
+  }
+  if (st.st_size == 0) return;
+
+  if (num_corpus_files % 1024 == 0)
+    corpus_files = (struct corpus_file *)realloc(corpus_files, (num_corpus_files + 1024) * sizeof(struct corpus_file));
+  corpus_files[num_corpus_files].name = strdup(name);
+  corpus_files[num_corpus_files].size = st.st_size;
+  num_corpus_files++;
+}
+
+/*
+ * 添加一个语料路径: 普通文件, 目录(递归, 按文件名排序, 跳过隐藏文件),
+ * 或者含有通配符的glob模式.
+ */
+void AddCorpusPath(char *path) {
+  struct stat st;
+  struct dirent **entries;
+  glob_t g;
+  char sub[MAX_PATH_STRING];
+  int a, n;
+
+  // glob模式: 结果已按字典序排好.
+  if (strpbrk(path, "*?[") != NULL) {
+    if (glob(path, 0, NULL, &g) != 0) {
+      printf("ERROR: no training data file matches %s\n", path);
+      exit(1);
+    }
+    for (a = 0; a < (int)g.gl_pathc; a++) AddCorpusPath(g.gl_pathv[a]);
+    globfree(&g);
+    return;
+  }
+
+  // 目录: 递归添加其中所有文件.
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    n = scandir(path, &entries, NULL, alphasort);
+    if (n < 0) {
+      printf("ERROR: cannot read training data directory %s\n", path);
+      exit(1);
+    }
+    for (a = 0; a < n; a++) {
+      if (entries[a]->d_name[0] != '.') {
+        snprintf(sub, MAX_PATH_STRING, "%s/%s", path, entries[a]->d_name);
+        AddCorpusPath(sub);
+      }
+      free(entries[a]);
+    }
+    free(entries);
+    return;
+  }
+
+  AddCorpusFile(path);
+}
+
+/*
+ * 解析train_file, 生成语料文件列表corpus_files, 并计算总字节数file_size.
+ *
+ * train_file格式: 逗号分隔的路径列表, 每一项可以是文件、目录或glob模式;
+ * 以'@'开头的项表示一个列表文件, 其中每行一个路径.
+ */
+void InitCorpusFiles() {
+  char spec[MAX_PATH_STRING], line[MAX_PATH_STRING], *item, *save;
+  FILE *fin;
+  long long len;
+  int a;
+
+  num_corpus_files = 0;
+  strcpy(spec, train_file);
+  for (item = strtok_r(spec, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+    if (item[0] != '@') {
+      AddCorpusPath(item);
+      continue;
+    }
+
+    // @列表文件: 每行一个路径.
+    fin = fopen(item + 1, "rb");
+    if (fin == NULL) {
+      printf("ERROR: training data list %s not found!\n", item + 1);
+      exit(1);
+    }
+    while (fgets(line, MAX_PATH_STRING, fin) != NULL) {
+      len = strlen(line);
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+      if (len > 0) AddCorpusPath(line);
+    }
+    fclose(fin);
+  }
+
+  if (num_corpus_files == 0) {
+    printf("ERROR: training data is empty!\n");
+    exit(1);
+  }
+
+  // 计算每个文件在虚拟字节流中的起始偏移.
+  file_size = 0;
+  for (a = 0; a < num_corpus_files; a++) {
+    corpus_files[a].offset = file_size;
+    file_size += corpus_files[a].size;
+  }
+}
+
+/*
+ * 将虚拟字节流按字节数均分为num份, 返回第id份的区间[start, end).
+ */
+void ShardRange(long long id, long long num, long long *start, long long *end) {
+  *start = file_size / num * id;
+  *end = (id == num - 1) ? file_size : file_size / num * (id + 1);
+}
+
+/*
+ * 读取器打开区间起点start所在的文件, 并定位到start.
+ * 如果start落在文件中间, 则跳过被截断的半个词.
+ */
+void ReaderRewind(struct corpus_reader *r) {
+  int a = 0, ch;
+  long long pos;
+
+  if (r->fin != NULL) fclose(r->fin);
+  r->fin = NULL;
+  r->pending[0] = 0;
+  r->pending_eof = 0;
+  r->eof = (r->start >= r->end);
+  if (r->eof) return;
+
+  while (a < num_corpus_files - 1 && corpus_files[a + 1].offset <= r->start) a++;
+  r->file = a;
+  r->fin = fopen(corpus_files[a].name, "rb");
+  if (r->fin == NULL) {
+    printf("ERROR: training data file %s not found!\n", corpus_files[a].name);
+    exit(1);
+  }
+
+  // start前一个字符属于上一个区间; 若它不是词边界, 说明start截断了一个词.
+  pos = r->start - corpus_files[a].offset;
+  if (pos > 0) {
+    fseek(r->fin, pos - 1, SEEK_SET);
+    ch = fgetc(r->fin);
+    if ((ch != ' ') && (ch != '\t') && (ch != '\n')) {
+      do ch = fgetc(r->fin); while ((ch != EOF) && (ch != ' ') && (ch != '\t') && (ch != '\n'));
+      if (ch == '\n') ungetc(ch, r->fin);
+    }
+  }
+}
+
+void ReaderOpen(struct corpus_reader *r, long long start, long long end) {
+  r->fin = NULL;
+  r->start = start;
+  r->end = end;
+  ReaderRewind(r);
+}
+
+void ReaderClose(struct corpus_reader *r) {
+  if (r->fin != NULL) fclose(r->fin);
+  r->fin = NULL;
+  r->eof = 1;
+}
+
+/*
+ * 从读取器中读取一个原始的word(不合并短语). 一个文件读完后自动切换到下一个文件;
+ * 起始位置已越过区间终点的词不再读取. 区间读完时返回0, 并置eof.
+ */
+int ReaderReadRawWord(struct corpus_reader *r, char *word) {
+  int ch;
+
+  while (!r->eof) {
+    // 区间终点落在当前文件内: 跳过词前的空白后, 检查词的起始位置是否越过终点.
+    if (corpus_files[r->file].offset + corpus_files[r->file].size > r->end) {
+      do ch = fgetc(r->fin); while ((ch == ' ') || (ch == '\t') || (ch == 13));
+      if (ch != EOF) ungetc(ch, r->fin);
+      if (corpus_files[r->file].offset + ftell(r->fin) >= r->end) break;
+    }
+
+    ReadWord(word, r->fin);
+    if (!feof(r->fin)) return 1;
+
+    // 当前文件读完, 切换到下一个文件.
+    fclose(r->fin);
+    r->fin = NULL;
+    r->file++;
+    if (r->file >= num_corpus_files || corpus_files[r->file].offset >= r->end) break;
+    r->fin = fopen(corpus_files[r->file].name, "rb");
+    if (r->fin == NULL) {
+      printf("ERROR: training data file %s not found!\n", corpus_files[r->file].name);
+      exit(1);
+    }
+  }
+
+  r->eof = 1;
+  return 0;
+}
+
+/*
+ * 计算一个word的64位原始hash值(未取模).
+ */
+unsigned long long HashWord(char *word) {
+  unsigned long long hash = 0;
+  for (; *word; word++) hash = hash * 257 + *word;
+  return hash;
+}
+
+/*
+ * 将64位hash值映射到[0, 2^bits)上. HashWord()的低位分布很差(257的低8位为1),
+ * 不能直接用于容量为2的幂的hash表, 这里取乘法散列的高位.
+ */
+long long MixHash(unsigned long long hash, int bits) {
+  return (hash * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+/**
+ * 词频统计线程的局部词表: 开放寻址hash, 装载率超过0.5时容量翻倍.
+ */
+struct vocab_counter {
+  char **word;              // 词
+  long long *cn;            // 词频
+  long long size,           // 词数
+       hash_size,           // hash表容量(2的幂)
+       *hash;               // hash表: 存放词在word/cn中的下标
+  int hash_bits;            // log2(hash_size)
+  long long words,          // 读取的总词数
+       skipped;             // -count-sketch: 估计词频 < min_count而没有计数的词数
+  long long id;             // 线程id, 即负责的语料分片
+  unsigned int *sketch;     // -count-sketch的第一遍: 本线程的sketch. NULL: 精确计数
+};
+
+// 所有统计线程已读取的总词数, 仅用于打印进度.
+long long vocab_progress = 0;
+
+// 选中的短语(键为"a b", 词频为bigram的词频), 见LearnPhrases(). 为空时读取语料不合并短语.
+struct vocab_counter phrases;
+
+/*
+ * 重建局部词表的hash表.
+ */
+void RehashVocabCounter(struct vocab_counter *vc) {
+  long long a, hash;
+
+  for (a = 0; a < vc->hash_size; a++) vc->hash[a] = -1;
+  for (a = 0; a < vc->size; a++) {
+    hash = MixHash(HashWord(vc->word[a]), vc->hash_bits);
+    while (vc->hash[hash] != -1) hash = (hash + 1) & (vc->hash_size - 1);
+    vc->hash[hash] = a;
+  }
+}
+
+/*
+ * 局部词表的容量翻倍, 并重建hash表.
+ */
+void GrowVocabCounter(struct vocab_counter *vc) {
+  vc->hash_bits = vc->hash_bits ? vc->hash_bits + 1 : 16;
+  vc->hash_size = 1LL << vc->hash_bits;
+  vc->word = (char **)realloc(vc->word, vc->hash_size / 2 * sizeof(char *));
+  vc->cn = (long long *)realloc(vc->cn, vc->hash_size / 2 * sizeof(long long));
+  free(vc->hash);
+  vc->hash = (long long *)malloc(vc->hash_size * sizeof(long long));
+  if (vc->word == NULL || vc->cn == NULL || vc->hash == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  RehashVocabCounter(vc);
+}
+
+/*
+ * word在局部词表的hash表中的位置: 已有该词时为它所在的位置, 否则为可以插入的空位.
+ */
+long long VocabCounterSlot(struct vocab_counter *vc, char *word) {
+  long long hash = MixHash(HashWord(word), vc->hash_bits);
+  while (vc->hash[hash] != -1 && strcmp(word, vc->word[vc->hash[hash]])) 
+      hash = (hash + 1) & (vc->hash_size - 1);
   return hash;
 }
 
+/*
+ * 在局部词表中查找word, 返回下标; 找不到返回-1.
+ */
+long long FindCountedWord(struct vocab_counter *vc, char *word) {
+  if (vc->size == 0) return -1;
+  return vc->hash[VocabCounterSlot(vc, word)];
+}
+
+/*
+ * 在局部词表中给word的词频加上n, 找不到则添加.
+ * word/cn只有hash_size / 2个元素, 因此在写入之前检查: 已满时先扩容, 再重新查找插入位置.
+ */
+void CountWord(struct vocab_counter *vc, char *word, long long n) {
+  long long hash = VocabCounterSlot(vc, word);
+
+  if (vc->hash[hash] != -1) {
+    vc->cn[vc->hash[hash]] += n;
+    return;
+  }
+  if (vc->size * 2 >= vc->hash_size) {
+    GrowVocabCounter(vc);
+    hash = VocabCounterSlot(vc, word);
+  }
+  vc->word[vc->size] = strdup(word);
+  vc->cn[vc->size] = n;
+  vc->hash[hash] = vc->size;
+  vc->size++;
+}
+
+/*
+ * 删除局部词表中词频 <= min的词, 并重建hash表(容量不变).
+ */
+void PruneVocabCounter(struct vocab_counter *vc, long long min) {
+  long long a, b = 0;
+
+  for (a = 0; a < vc->size; a++) {
+    if (vc->cn[a] > min) {
+      vc->word[b] = vc->word[a];
+      vc->cn[b] = vc->cn[a];
+      b++;
+    } else free(vc->word[a]);
+  }
+  vc->size = b;
+  RehashVocabCounter(vc);
+}
+
+/*
+ * 释放局部词表.
+ */
+void FreeVocabCounter(struct vocab_counter *vc) {
+  long long a;
+
+  for (a = 0; a < vc->size; a++) free(vc->word[a]);
+  free(vc->word);
+  free(vc->cn);
+  free(vc->hash);
+  memset(vc, 0, sizeof(struct vocab_counter));
+}
+
+/*
+ * 短语的键"a b"(空格不会出现在词中). 合并后的词"a_b"超过MAX_STRING - 1个字符时不作为短语, 返回0.
+ */
+int PhraseKey(char *a, char *b, char *key) {
+  long long la = strlen(a), lb = strlen(b);
+
+  if (la + lb + 1 >= MAX_STRING) return 0;
+  memcpy(key, a, la);
+  key[la] = ' ';
+  memcpy(key + la + 1, b, lb + 1);
+  return 1;
+}
+
+/*
+ * 从读取器中读取一个word, 并合并短语: 有短语表时预读下一个词, 两个词组成选中的短语时
+ * 返回合并后的"a_b"; 否则预读的词留到下一次调用返回. 句子边界</s>不参与合并.
+ */
+int ReaderReadWord(struct corpus_reader *r, char *word) {
+  char key[MAX_STRING];
+
+  if (phrases.size == 0) return ReaderReadRawWord(r, word);
+
+  // a.当前词: 上一次预读的词, 或从语料读取.
+  if (r->pending[0] != 0) {
+    strcpy(word, r->pending);
+    r->pending[0] = 0;
+  } else if (r->pending_eof || !ReaderReadRawWord(r, word)) {
+    r->eof = 1;
+    return 0;
+  }
+  if (r->pending_eof || !strcmp(word, "</s>")) return 1;
+
+  // b.预读下一个词. 区间已读完时当前词仍然有效: 清除eof, 下一次调用再返回0.
+  if (!ReaderReadRawWord(r, r->pending)) {
+    r->pending[0] = 0;
+    r->pending_eof = 1;
+    r->eof = 0;
+    return 1;
+  }
+
+  // c.组成短语则合并.
+  if (strcmp(r->pending, "</s>") && PhraseKey(word, r->pending, key) && FindCountedWord(&phrases, key) != -1) {
+    key[strlen(word)] = '_';
+    strcpy(word, key);
+    r->pending[0] = 0;
+  }
+  return 1;
+}
+
+
+/*
+ * 计算一个word在vocab_hash中的位置.
+ */
+// Returns hash value of a word
+long long GetWordHash(char *word) {
+  return MixHash(HashWord(word), vocab_hash_bits);
+}
+
+/*
+ * 把word插入vocab_hash, 对应vocab中的下标a.
+ */
+void InsertVocabHash(char *word, long long a) {
+  long long hash = GetWordHash(word);
+  while (vocab_hash[hash] != -1) hash = (hash + 1) & (vocab_hash_size - 1);
+  vocab_hash[hash] = a;
+}
+
+/*
+ * 清空vocab_hash, 并保证容量能以装载率0.7容纳words个词.
+ */
+void ResetVocabHash(long long words) {
+  long long a;
+  int bits = 20;
+
+  while ((1LL << bits) * 0.7 < words) bits++;
+  if (bits != vocab_hash_bits) {
+    free(vocab_hash);
+    vocab_hash_bits = bits;
+    vocab_hash_size = 1LL << bits;
+    vocab_hash = (long long *)malloc(vocab_hash_size * sizeof(long long));
+    if (vocab_hash == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  }
+  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+}
+
+/*
+ * vocab_hash的容量翻倍, 重新插入所有词.
+ */
+void GrowVocabHash() {
+  long long a;
+
+  ResetVocabHash(vocab_hash_size * 2 * 0.7);
+  for (a = 0; a < vocab_size; a++) InsertVocabHash(vocab[a].word, a);
+}
+
 
 /** 
  * 搜索word对应在vocab中的索引.
  *
  */
 // Returns position of a word in the vocabulary; if the word is not found, returns -1
-int SearchVocab(char *word) {
+long long SearchVocab(char *word) {
 
   // 计算hash值.
-  unsigned int hash = GetWordHash(word);
+  long long hash = GetWordHash(word);
 
   // 检索对应的索引, 在vocab上的word，比较是否相等.
   // 如果找到，则返回对应的vocab索引.
@@ -236,21 +928,20 @@ int SearchVocab(char *word) {
     if (!strcmp(word, vocab[vocab_hash[hash]].word)) 
         return vocab_hash[hash];
     
-    hash = (hash + 1) % vocab_hash_size;
+    hash = (hash + 1) & (vocab_hash_size - 1);
   }
 
   return -1;
 }
 
 /**
- * 在文件指针fin上，读取一个word, 并返回它在vocab上的索引. 
+ * 在读取器r上，读取一个word, 并返回它在vocab上的索引. 
  */
 // Reads a word and returns its index in the vocabulary
-int ReadWordIndex(FILE *fin) {
+long long ReadWordIndex(struct corpus_reader *r) {
   char word[MAX_STRING];
-  ReadWord(word, fin);
 
-  if (feof(fin)) 
+  if (!ReaderReadWord(r, word)) 
       return -1;
   
   return SearchVocab(word);
@@ -260,8 +951,8 @@ int ReadWordIndex(FILE *fin) {
  * 将一个word添加到词汇表中.
  */
 // Adds a word to the vocabulary
-int AddWordToVocab(char *word) {
-  unsigned int hash, length = strlen(word) + 1;
+long long AddWordToVocab(char *word) {
+  unsigned int length = strlen(word) + 1;
   if (length > MAX_STRING) length = MAX_STRING;
   
   // vocab(word,cnt)  动态分配内存
@@ -270,17 +961,17 @@ int AddWordToVocab(char *word) {
   vocab[vocab_size].cn = 0;
   vocab_size++;
 
-  // 如果vocab过小，重新分配内存.
+  // 如果vocab过小，重新分配内存(容量翻倍, 上千万词时不必反复复制).
   // Reallocate memory if needed
   if (vocab_size + 2 >= vocab_max_size) {
-    vocab_max_size += 1000;
+    vocab_max_size *= 2;
     vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+    if (vocab == NULL) {printf("Memory allocation failed\n"); exit(1);}
   }
 
-  // 计算该word的hash值. 保存对应word的词汇size.
-  hash = GetWordHash(word);
-  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-  vocab_hash[hash] = vocab_size - 1;
+  // 插入hash表, 装载率超过0.7时扩容.
+  if (vocab_size > vocab_hash_size * 0.7) GrowVocabHash();
+  else InsertVocabHash(word, vocab_size - 1);
   
   // 返回当前词汇的size.
   return vocab_size - 1;
@@ -291,7 +982,25 @@ int AddWordToVocab(char *word) {
  */
 // Used later for sorting by word counts
 int VocabCompare(const void *a, const void *b) {
-    return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+    long long ca = ((struct vocab_word *)a)->cn, cb = ((struct vocab_word *)b)->cn;
+    return (cb > ca) - (cb < ca);
+}
+
+/*
+ * 词汇表本身每个词汇，都是一个节点. node(code,point)
+ * 所有词的code/point各在一整块内存中(每个词MAX_CODE_LENGTH项), 上千万词时省去逐词分配.
+ */
+// Allocate memory for the binary tree construction
+void AllocVocabCodes() {
+  long long a;
+  char *code = (char *)calloc(vocab_size * MAX_CODE_LENGTH, sizeof(char));
+  int *point = (int *)calloc(vocab_size * MAX_CODE_LENGTH, sizeof(int));
+
+  if (code == NULL || point == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < vocab_size; a++) {
+    vocab[a].code = code + a * MAX_CODE_LENGTH;
+    vocab[a].point = point + a * MAX_CODE_LENGTH;
+  }
 }
 
 /**
@@ -299,16 +1008,14 @@ int VocabCompare(const void *a, const void *b) {
  */
 // Sorts the vocabulary by frequency using word counts
 void SortVocab() {
-  int a, size;
-  unsigned int hash;
+  long long a, size;
 
   // 根据cnt进行排序 => vocab.(从大到小)
   // Sort the vocabulary and keep </s> at the first position
   qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
   
   // 初始化.
-  for (a = 0; a < vocab_hash_size; a++)
-      vocab_hash[a] = -1;
+  ResetVocabHash(vocab_size);
   
   size = vocab_size;
 
@@ -323,234 +1030,350 @@ void SortVocab() {
       free(vocab[a].word);
     } else {
       // Hash will be re-computed, as after the sorting it is not actual
-      hash=GetWordHash(vocab[a].word);
-      
-      // 冲突.
-      while (vocab_hash[hash] != -1) 
-          hash = (hash + 1) % vocab_hash_size;
-
-      // 重置索引.
-      vocab_hash[hash] = a;
+      InsertVocabHash(vocab[a].word, a);
       train_words += vocab[a].cn;
     }
   }
 
   // 重新分配内存=>vocab.
   vocab = (struct vocab_word *)realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
-
-  // 词汇表本身每个词汇，都是一个节点. node(code,point)
-  // Allocate memory for the binary tree construction
-  for (a = 0; a < vocab_size; a++) {
-    vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
-    vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
-  }
+  AllocVocabCodes();
 }
 
 /*
- * 移除词汇表中，不频繁的token
+ * 返回单调时钟的当前时间(秒).
  */
-// Reduces the vocabulary by removing infrequent tokens
-void ReduceVocab() {
-  int a, b = 0;
-  unsigned int hash;
-  
-  // cnt < min_reduce: 释放内存.
-  // 否则在内存上进行移位下.
-  for (a = 0; a < vocab_size; a++) 
-    if (vocab[a].cn > min_reduce) {
-        vocab[b].cn = vocab[a].cn;
-        vocab[b].word = vocab[a].word;
-        b++;
-    } else free(vocab[a].word);
-
-  // 新的词汇size.
-  vocab_size = b;
-
-  // hash重置为-1.
-  for (a = 0; a < vocab_hash_size; a++)
-      vocab_hash[a] = -1;
-  
-  // 重新计算hash.
-  for (a = 0; a < vocab_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(vocab[a].word);
-
-    // 若冲突，hash+1.
-    while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    vocab_hash[hash] = a;
-  }
+double WallTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-  // 
-  fflush(stdout);
-  min_reduce++;
+/*
+ * HuffmanTree()的叶子回调: 把编码与路径复制给对应的词.
+ */
+void SetWordCode(long long word, const char *code, const int *point, int codelen, void *arg) {
+  vocab[word].codelen = codelen;
+  memcpy(vocab[word].code, code, codelen);
+  memcpy(vocab[word].point, point, (codelen + 1) * sizeof(int));
 }
 
 /**
  * 使用词频创建一棵的Huffman树. 频率高的字将具有更短
- * 的Huffman二进制码(binary code).
+ * 的Huffman二进制码(binary code). 构建与编码分配见huffman_tree.h.
  *
  */
 // Create binary Huffman tree using the word counts
 // Frequent words will have short uniqe binary codes
 void CreateBinaryTree() {
-  long long a, 
-       b, 
-       i, 
-       min1i, 
-       min2i, 
-       pos1, 
-       pos2, 
-       point[MAX_CODE_LENGTH];
+  int status = HuffmanTree(vocab_size, &vocab[0].cn, sizeof(struct vocab_word), hs_layout, SetWordCode, NULL);
+
+  if (status == HUFFMAN_NO_MEMORY) {printf("Memory allocation failed\n"); exit(1);}
+  if (status == HUFFMAN_TOO_DEEP) {
+    printf("ERROR: Huffman code longer than %d bits\n", MAX_CODE_LENGTH - 1);
+    exit(1);
+  }
+}
 
+/*
+ * 词的64位hash在sketch第r行中的位置. 每行用不同的乘数做乘法散列, 各行的冲突相互独立.
+ */
+static inline long long SketchSlot(unsigned long long hash, int r) {
+  static const unsigned long long mult[SKETCH_DEPTH] = {
+    0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+  };
+  hash ^= hash >> 29;
+  return ((long long)r << sketch_bits) + (long long)((hash * mult[r]) >> (64 - sketch_bits));
+}
 
-  char code[MAX_CODE_LENGTH];
+/*
+ * sketch对一个词的词频估计: 各行计数的最小值, 不会小于真实词频.
+ */
+unsigned int SketchEstimate(const unsigned int *sketch, unsigned long long hash) {
+  unsigned int m = sketch[SketchSlot(hash, 0)], c;
+  int r;
 
+  for (r = 1; r < SKETCH_DEPTH; r++) {
+    c = sketch[SketchSlot(hash, r)];
+    if (c < m) m = c;
+  }
+  return m;
+}
 
-  // count: 词频.
-  // binary: huffman二进制编码
-  // parent_node: 
-  long long *count = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-  long long *binary = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-  long long *parent_node = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
+/*
+ * 在sketch中给一个词计数一次. 保守更新: 只把小于 估计值 + 1 的计数提高到 估计值 + 1,
+ * 仍然不会低估, 但高频词的冲突对低频词估计值的影响小很多. 计数在2^32 - 1处饱和.
+ */
+void SketchAdd(unsigned int *sketch, unsigned long long hash) {
+  unsigned int m = SketchEstimate(sketch, hash);
+  long long slot;
+  int r;
+
+  if (m == 0xFFFFFFFFu) return;
+  for (r = 0; r < SKETCH_DEPTH; r++) {
+    slot = SketchSlot(hash, r);
+    if (sketch[slot] < m + 1) sketch[slot] = m + 1;
+  }
+}
 
-  // 初始化count数组的前一半
-  for (a = 0; a < vocab_size; a++) 
-      count[a] = vocab[a].cn;
+/*
+ * 统计线程: 读取第id个语料分片. vc->sketch不为NULL时只在sketch中近似计数(第一遍);
+ * 否则在局部词表中精确累加词频, 有合并后的vocab_sketch时跳过估计词频 < min_count的词.
+ */
+void *LearnVocabThread(void *arg) {
+  struct vocab_counter *vc = (struct vocab_counter *)arg;
+  struct corpus_reader reader;
+  char word[MAX_STRING];
+  long long start, end, progress;
 
-  // 初始化count数组的后一半，用于交换. 赋很大值.
-  for (a = vocab_size; a < vocab_size * 2; a++) 
-      count[a] = 1e15;
+  ShardRange(vc->id, num_threads, &start, &end);
+  ReaderOpen(&reader, start, end);
+  if (vc->sketch == NULL) GrowVocabCounter(vc);
 
-  // 
-  pos1 = vocab_size - 1;
-  pos2 = vocab_size;
-  
-  // 最小值，pos1, pos2间进行比较.
-  // [这里的设计有些精巧.]
-  // 根据算法构建Huffman树，一次增加一个节点.
-  // Following algorithm constructs the Huffman tree by adding one node at a time
-  for (a = 0; a < vocab_size - 1; a++) {
-
-    // First, find two smallest nodes 'min1, min2'
-    if (pos1 >= 0) {
-
-      // 第1个：min1i. 遍历所有词汇的count，比较count；取较小值.
-      if (count[pos1] < count[pos2]) {
-        min1i = pos1;
-        pos1--;
-      } else {
-        min1i = pos2;
-        pos2++;
+  while (ReaderReadWord(&reader, word)) {
+
+    // 训练word数，自增. 每10万词汇总一次进度.
+    vc->words++;
+    if (vc->words % 100000 == 0) {
+      progress = __sync_add_and_fetch(&vocab_progress, 100000);
+      if ((debug_mode > 1) && (progress % (100000 * num_threads) == 0)) {
+        printf("%lldK%c", progress / 1000, 13);
+        fflush(stdout);
       }
-    } else {  
-      min1i = pos2;
-      pos2++;
     }
 
-    // 第2个: min2i.
-    if (pos1 >= 0) {
-      if (count[pos1] < count[pos2]) {
-        min2i = pos1;
-        pos1--;
-      } else {
-        min2i = pos2;
-        pos2++;
-      }
-    } else {
-      min2i = pos2;
-      pos2++;
+    if (vc->sketch != NULL) {
+      SketchAdd(vc->sketch, HashWord(word));
+      continue;
+    }
+    if (vocab_sketch != NULL && SketchEstimate(vocab_sketch, HashWord(word)) < (unsigned int)min_count) {
+      vc->skipped++;
+      continue;
     }
 
-    // 为count/parent_node/binary赋值. 
-    count[vocab_size + a] = count[min1i] + count[min2i];
-    parent_node[min1i] = vocab_size + a;
-    parent_node[min2i] = vocab_size + a;
-    binary[min2i] = 1;
+    // 在局部词表中查找, 找不到则添加.
+    CountWord(vc, word, 1);
   }
 
-  // 将二进制编码分配给词汇表中每个词汇.
-  // Now assign binary code to each vocabulary word
-  for (a = 0; a < vocab_size; a++) {
-    b = a;
-    i = 0;
-
-    // 根据parent_node向上递归，获得Huffman编码：code. 
-    // 以及路径:point
-    while (1) {
-      code[i] = binary[b];
-      point[i] = b;
-      i++;
+  ReaderClose(&reader);
+  pthread_exit(NULL);
+}
 
-      b = parent_node[b];
-      if (b == vocab_size * 2 - 2) 
-          break;
-    }
+/*
+ * -count-sketch的第一遍: 每个线程在自己的sketch中统计一个分片, 再逐项相加合并为vocab_sketch
+ * (各分片的估计都不低于真实词频, 相加后仍然如此).
+ */
+void CountSketchPass(pthread_t *pt, struct vocab_counter *vc) {
+  long long a, b, n, bytes = count_sketch << 20;
+  unsigned int sum;
+
+  for (sketch_bits = 1; ((long long)SKETCH_DEPTH << (sketch_bits + 1)) * (long long)sizeof(unsigned int) <= bytes; sketch_bits++);
+  n = (long long)SKETCH_DEPTH << sketch_bits;
+  for (a = 0; a < num_threads; a++) {
+    vc[a].id = a;
+    vc[a].sketch = (unsigned int *)calloc(n, sizeof(unsigned int));
+    if (vc[a].sketch == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    pthread_create(&pt[a], NULL, LearnVocabThread, (void *)&vc[a]);
+  }
+  for (a = 0; a < num_threads; a++) 
+      pthread_join(pt[a], NULL);
+
+  for (a = 1; a < num_threads; a++) {
+    for (b = 0; b < n; b++) {
+      sum = vc[0].sketch[b] + vc[a].sketch[b];
+      vc[0].sketch[b] = sum < vc[0].sketch[b] ? 0xFFFFFFFFu : sum;
+    }
+    free(vc[a].sketch);
+  }
+  vocab_sketch = vc[0].sketch;
+  memset(vc, 0, num_threads * sizeof(struct vocab_counter));
+  vocab_progress = 0;
+  if (debug_mode > 1) printf("Count sketch: %d x %lld counters, %lld MB per thread\n", SKETCH_DEPTH, 1LL << sketch_bits, n * (long long)sizeof(unsigned int) >> 20);
+}
 
-    // 得到huffman编码长度
-    vocab[a].codelen = i;
+/**
+ * 短语统计线程的局部计数: unigram精确计数, bigram超过上限时删除低频项.
+ */
+struct phrase_counter {
+  struct vocab_counter uni,     // unigram
+       bi;                      // bigram, 键为"a b"
+  long long reduce,             // 已删除词频 <= reduce的bigram
+       limit,                   // bigram个数的上限
+       id;                      // 线程id, 即负责的语料分片
+};
 
-    // 得到word对应的Huffman编码code; 以及路径: point
-    vocab[a].point[0] = vocab_size - 2;
-    
-    for (b = 0; b < i; b++) {
-      vocab[a].code[i - b - 1] = code[b];
-      vocab[a].point[i - b] = point[b] - vocab_size;
+/*
+ * bigram个数超过上限时, 逐步提高reduce删除低频bigram, 直到不超过上限的一半.
+ * 删除后再出现的bigram从0重新计数, 所以词频可能偏低(与word2phrase相同的近似).
+ */
+void PruneBigrams(struct phrase_counter *pc) {
+  while (pc->bi.size > pc->limit / 2) PruneVocabCounter(&pc->bi, ++pc->reduce);
+}
+
+/*
+ * 短语统计线程: 读取第id个语料分片, 统计unigram与句子内相邻两个词的bigram.
+ */
+void *LearnPhraseThread(void *arg) {
+  struct phrase_counter *pc = (struct phrase_counter *)arg;
+  struct corpus_reader reader;
+  char word[MAX_STRING], last[MAX_STRING], key[MAX_STRING];
+  long long start, end, progress;
+
+  ShardRange(pc->id, num_threads, &start, &end);
+  ReaderOpen(&reader, start, end);
+  GrowVocabCounter(&pc->uni);
+  GrowVocabCounter(&pc->bi);
+
+  last[0] = 0;
+  while (ReaderReadRawWord(&reader, word)) {
+    pc->uni.words++;
+    if (pc->uni.words % 100000 == 0) {
+      progress = __sync_add_and_fetch(&vocab_progress, 100000);
+      if ((debug_mode > 1) && (progress % (100000 * num_threads) == 0)) {
+        printf("%lldK%c", progress / 1000, 13);
+        fflush(stdout);
+      }
+    }
+
+    // 句子边界不参与短语.
+    if (!strcmp(word, "</s>")) {
+      last[0] = 0;
+      continue;
+    }
+    CountWord(&pc->uni, word, 1);
+    if (last[0] != 0 && PhraseKey(last, word, key)) {
+      CountWord(&pc->bi, key, 1);
+      if (pc->bi.size > pc->limit) PruneBigrams(pc);
+    }
+    strcpy(last, word);
+  }
+
+  ReaderClose(&reader);
+  pthread_exit(NULL);
+}
+
+/*
+ * 短语检测(与word2phrase相同的打分): 并行统计unigram和bigram, 合并后对每个bigram (a, b)计算
+ *   score = (cn(ab) - phrase_min_count) / cn(a) / cn(b) * 总词数,
+ * score > phrase_threshold的bigram选为短语, 存入phrases. 之后读取语料时ReaderReadWord()
+ * 直接把短语合并为一个词"a_b", 词汇表与训练都使用合并后的词, 不需要生成中间文件.
+ *
+ * bigram的个数在每个线程中不超过phrase_max_bigrams / num_threads, 合并后不超过phrase_max_bigrams.
+ */
+void LearnPhrases() {
+  long long a, b, i, j, words = 0;
+  char key[MAX_STRING], *sep;
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  struct phrase_counter *pc = (struct phrase_counter *)calloc(num_threads, sizeof(struct phrase_counter));
+  struct phrase_counter all;
+  real score;
+
+  // 并行统计各个分片.
+  vocab_progress = 0;
+  for (a = 0; a < num_threads; a++) {
+    pc[a].id = a;
+    pc[a].limit = phrase_max_bigrams / num_threads > 1024 ? phrase_max_bigrams / num_threads : 1024;
+    pthread_create(&pt[a], NULL, LearnPhraseThread, (void *)&pc[a]);
+  }
+  for (a = 0; a < num_threads; a++) 
+      pthread_join(pt[a], NULL);
+  vocab_progress = 0;
+
+  // 合并: 任一线程删除过词频 <= reduce的bigram, 合并后低于它的词频都不可靠, 一并删除.
+  memset(&all, 0, sizeof(struct phrase_counter));
+  all.limit = phrase_max_bigrams > 1024 ? phrase_max_bigrams : 1024;
+  GrowVocabCounter(&all.uni);
+  GrowVocabCounter(&all.bi);
+  for (a = 0; a < num_threads; a++) {
+    words += pc[a].uni.words;
+    if (pc[a].reduce > all.reduce) all.reduce = pc[a].reduce;
+    for (b = 0; b < pc[a].uni.size; b++) CountWord(&all.uni, pc[a].uni.word[b], pc[a].uni.cn[b]);
+    FreeVocabCounter(&pc[a].uni);
+    for (b = 0; b < pc[a].bi.size; b++) {
+      CountWord(&all.bi, pc[a].bi.word[b], pc[a].bi.cn[b]);
+      if (all.bi.size > all.limit) PruneBigrams(&all);
     }
+    FreeVocabCounter(&pc[a].bi);
+  }
+  if (all.reduce > 0) PruneVocabCounter(&all.bi, all.reduce);
+
+  // 打分, 选出短语.
+  FreeVocabCounter(&phrases);
+  GrowVocabCounter(&phrases);
+  for (b = 0; b < all.bi.size; b++) {
+    if (all.bi.cn[b] < phrase_min_count) continue;
+    strcpy(key, all.bi.word[b]);
+    sep = strchr(key, ' ');
+    *sep = 0;
+    i = FindCountedWord(&all.uni, key);
+    j = FindCountedWord(&all.uni, sep + 1);
+    if (i == -1 || j == -1 || all.uni.cn[i] < phrase_min_count || all.uni.cn[j] < phrase_min_count) continue;
+    score = (all.bi.cn[b] - phrase_min_count) / (real)all.uni.cn[i] / all.uni.cn[j] * words;
+    if (score > phrase_threshold) CountWord(&phrases, all.bi.word[b], all.bi.cn[b]);
   }
 
-  // 释放内存.
-  free(count);
-  free(binary);
-  free(parent_node);
+  if (debug_mode > 0) {
+    printf("Phrases: %lld of %lld bigrams", phrases.size, all.bi.size);
+    if (all.reduce > 0) printf(" (bigrams seen <= %lld times were pruned)", all.reduce);
+    printf("\n");
+  }
+  FreeVocabCounter(&all.uni);
+  FreeVocabCounter(&all.bi);
+  free(pc);
+  free(pt);
 }
 
 /*
  * 从语料加生成词汇表.
+ *
+ * 语料按字节数切分为num_threads个分片, 每个线程在局部词表中统计一个分片,
+ * 最后按线程顺序合并到全局词汇表中. 全局词汇表与hash表按需增长, 所有词的词频都是精确的.
+ * -count-sketch时先用count-min sketch近似统计一遍, 第二遍只对可能达到min_count的词精确计数.
  */
 void LearnVocabFromTrainFile() {
-  char word[MAX_STRING];
-  FILE *fin;
-  long long a, i;
+  long long a, b, i, skipped = 0;
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  struct vocab_counter *vc = (struct vocab_counter *)calloc(num_threads, sizeof(struct vocab_counter));
 
   // 初始化词汇表.
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  
-  // 读取训练文件.
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
-    exit(1);
-  }
+  ResetVocabHash(0);
   
   // 添加word到词汇表中.
   vocab_size = 0;
   AddWordToVocab((char *)"</s>");
   
-  // 循环读取文件 
-  while (1) {
-
-    // 读取一个词=> word
-    ReadWord(word, fin);
-    if (feof(fin)) break;
+  // 并行统计各个分片.
+  if (count_sketch > 0) CountSketchPass(pt, vc);
+  for (a = 0; a < num_threads; a++) {
+    vc[a].id = a;
+    pthread_create(&pt[a], NULL, LearnVocabThread, (void *)&vc[a]);
+  }
+  for (a = 0; a < num_threads; a++) 
+      pthread_join(pt[a], NULL);
+  free(vocab_sketch);
+  vocab_sketch = NULL;
 
-    // 训练word数，自增
-    train_words++;
-    if ((debug_mode > 1) && (train_words % 100000 == 0)) {
-      printf("%lldK%c", train_words / 1000, 13);
-      fflush(stdout);
+  // 合并局部词表.
+  train_words = 0;
+  for (a = 0; a < num_threads; a++) {
+    train_words += vc[a].words;
+    skipped += vc[a].skipped;
+    for (b = 0; b < vc[a].size; b++) {
+
+      // 搜索词汇表，返回索引，增加count数.
+      i = SearchVocab(vc[a].word[b]);
+      if (i == -1) {
+        i = AddWordToVocab(vc[a].word[b]);
+        vocab[i].cn = vc[a].cn[b];
+      } else vocab[i].cn += vc[a].cn[b];
+      free(vc[a].word[b]);
     }
-
-    // 搜索词汇表，返回索引，增加count数.
-    i = SearchVocab(word);
-    
-    if (i == -1) {
-      a = AddWordToVocab(word);
-      vocab[a].cn = 1;
-    } else vocab[i].cn++;
-    
-    // 如果词汇size过大，减小内存.
-    if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
+    free(vc[a].word);
+    free(vc[a].cn);
+    free(vc[a].hash);
   }
+  free(vc);
+  free(pt);
   
   // sort排序
   SortVocab();
@@ -559,21 +1382,128 @@ void LearnVocabFromTrainFile() {
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
+    if (count_sketch > 0) printf("Words skipped by the count sketch: %lld\n", skipped);
   }
-
-  // 
-  file_size = ftell(fin);
-  fclose(fin);
 }
 
 /**
- * 保存词汇表到save_vocab_file中. (word, cnt)
+ * 二进制词汇表文件(-vocab-binary 1)的文件头. 之后依次为词频cn[V], 词在字符串池中的
+ * 偏移index[V + 1], 以及字符串池(各词以0结尾). 词的顺序与文本格式相同(按词频从大到小, </s>在首位).
+ */
+struct vocab_file_header {
+  char magic[8];            // "W2VVOCBN"
+  long long version,        // 1
+       vocab_size,
+       pool_bytes;          // 字符串池的字节数
+};
+
+/**
+ * 保存词汇表到save_vocab_file中. 文本格式每行一个(word, cnt), 便于查看; -vocab-binary 1时为二进制格式.
  */
 void SaveVocab() {
-  long long i;
+  struct vocab_file_header h;
+  long long i, *index;
+  int ok = 1;
   FILE *fo = fopen(save_vocab_file, "wb");
-  for (i = 0; i < vocab_size; i++) fprintf(fo, "%s %lld\n", vocab[i].word, vocab[i].cn);
-  fclose(fo);
+
+  if (fo == NULL) {
+    printf("ERROR: cannot open vocabulary file %s\n", save_vocab_file);
+    exit(1);
+  }
+  if (!vocab_binary) {
+    for (i = 0; i < vocab_size; i++) fprintf(fo, "%s %lld\n", vocab[i].word, vocab[i].cn);
+    fclose(fo);
+    return;
+  }
+
+  index = (long long *)malloc((vocab_size + 1) * sizeof(long long));
+  if (index == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  index[0] = 0;
+  for (i = 0; i < vocab_size; i++) index[i + 1] = index[i] + strlen(vocab[i].word) + 1;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "W2VVOCBN", 8);
+  h.version = 1;
+  h.vocab_size = vocab_size;
+  h.pool_bytes = index[vocab_size];
+  ok &= fwrite(&h, sizeof(h), 1, fo) == 1;
+  for (i = 0; i < vocab_size; i++) ok &= fwrite(&vocab[i].cn, sizeof(long long), 1, fo) == 1;
+  ok &= fwrite(index, sizeof(long long), vocab_size + 1, fo) == (size_t)(vocab_size + 1);
+  for (i = 0; i < vocab_size; i++) ok &= fwrite(vocab[i].word, 1, index[i + 1] - index[i], fo) == (size_t)(index[i + 1] - index[i]);
+  ok &= fclose(fo) == 0;
+  if (!ok) {
+    printf("ERROR: cannot write vocabulary file %s\n", save_vocab_file);
+    exit(1);
+  }
+  free(index);
+}
+
+/*
+ * 读取二进制格式的词汇表: 整个文件mmap(MAP_PRIVATE), 词直接指向映射中的字符串池.
+ * 文件已按词频排好序时不再排序, 只截掉词频 < min_count的词, 再一次性建好hash表.
+ * 使用之前检查文件大小、字符串下标(单调, 最后一项为字符串池的大小)和每个词末尾的0, 损坏的文件报错退出.
+ * 不是二进制格式时返回0.
+ */
+int ReadBinaryVocab() {
+  struct vocab_file_header *h;
+  struct stat st;
+  long long a, *cn, *index;
+  char *m, *pool;
+  int sorted = 1, fd = open(read_vocab_file, O_RDONLY);
+
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) != 0 || st.st_size < (long long)sizeof(struct vocab_file_header)) {close(fd); return 0;}
+  m = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) return 0;
+  h = (struct vocab_file_header *)m;
+  if (memcmp(h->magic, "W2VVOCBN", 8)) {
+    munmap(m, st.st_size);
+    return 0;
+  }
+  // 先检查词数和字符串池的大小本身(避免下面的乘法溢出), 再检查文件大小.
+  if (h->version != 1 || h->vocab_size < 1 || h->vocab_size > st.st_size / (2 * (long long)sizeof(long long)) ||
+      h->pool_bytes < h->vocab_size || h->pool_bytes > st.st_size ||
+      st.st_size != (long long)sizeof(struct vocab_file_header) + (h->vocab_size * 2 + 1) * (long long)sizeof(long long) + h->pool_bytes) {
+    printf("ERROR: invalid vocabulary file %s\n", read_vocab_file);
+    exit(1);
+  }
+  cn = (long long *)(m + sizeof(struct vocab_file_header));
+  index = cn + h->vocab_size;
+  pool = (char *)(index + h->vocab_size + 1);
+  if (index[0] != 0 || index[h->vocab_size] != h->pool_bytes) {
+    printf("ERROR: invalid vocabulary file %s\n", read_vocab_file);
+    exit(1);
+  }
+  for (a = 0; a < h->vocab_size; a++) {
+    if (index[a + 1] <= index[a] || index[a + 1] > h->pool_bytes || pool[index[a + 1] - 1] != 0) {
+      printf("ERROR: invalid vocabulary file %s (word %lld)\n", read_vocab_file, a);
+      exit(1);
+    }
+  }
+
+  // 词与词频.
+  vocab_size = h->vocab_size;
+  vocab_max_size = vocab_size + 1;
+  vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+  if (vocab == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < vocab_size; a++) {
+    vocab[a].cn = cn[a];
+    vocab[a].word = pool + index[a];
+    if (a > 1 && cn[a] > cn[a - 1]) sorted = 0;
+  }
+  if (!sorted) qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
+
+  // 截掉低频词, 建hash表.
+  for (a = 1; a < vocab_size && vocab[a].cn >= min_count; a++);
+  vocab_size = a;
+  ResetVocabHash(vocab_size);
+  train_words = 0;
+  for (a = 0; a < vocab_size; a++) {
+    InsertVocabHash(vocab[a].word, a);
+    train_words += vocab[a].cn;
+  }
+  AllocVocabCodes();
+  return 1;
 }
 
 /**
@@ -583,16 +1513,26 @@ void ReadVocab() {
   long long a, i = 0;
   char c;
   char word[MAX_STRING];
+  FILE *fin;
+
+  // 二进制格式.
+  if (ReadBinaryVocab()) {
+    if (debug_mode > 0) {
+      printf("Vocab size: %lld\n", vocab_size);
+      printf("Words in train file: %lld\n", train_words);
+    }
+    return;
+  }
 
   // 打开读取的词汇表.
-  FILE *fin = fopen(read_vocab_file, "rb");
+  fin = fopen(read_vocab_file, "rb");
   if (fin == NULL) {
     printf("Vocabulary file not found\n");
     exit(1);
   }
 
   // 读取word，存到内存vocab中
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  ResetVocabHash(0);
   vocab_size = 0;
   while (1) {
     ReadWord(word, fin);
@@ -603,19 +1543,384 @@ void ReadVocab() {
   }
 
   // 
+  fclose(fin);
   SortVocab();
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
+}
+
+/*
+ * 词word的字符n-gram在bucket中的序号, 写入ngrams, 返回个数(最多(MAX_STRING + 2) * (maxn - minn + 1)个).
+ * n-gram为"<word>"中长度在[minn, maxn]之间的子串(按UTF-8字符计, 不含"<word>"本身),
+ * hash为FNV-1a. </s>没有n-gram.
+ */
+long long WordNgrams(char *word, int *ngrams) {
+  char w[MAX_STRING + 2];
+  long long i, j, n, len, count = 0;
+  unsigned int h;
+
+  if (!strcmp(word, "</s>")) return 0;
+  len = strlen(word);
+  w[0] = '<';
+  memcpy(w + 1, word, len);
+  w[len + 1] = '>';
+  len += 2;
+
+  for (i = 0; i < len; i++) {
+    if ((w[i] & 0xC0) == 0x80) continue;
+    h = 2166136261u;
+    for (j = i, n = 1; j < len && n <= subword_maxn; n++) {
+      // 追加一个UTF-8字符.
+      do h = (h ^ (unsigned char)w[j++]) * 16777619u; while (j < len && (w[j] & 0xC0) == 0x80);
+      if (n >= subword_minn && !(i == 0 && j == len)) ngrams[count++] = h % subword_buckets;
+    }
+  }
+  return count;
+}
+
+/*
+ * 预先计算每个词的输入行列表(自身行, 以及vocab_size + 各n-gram的bucket), 按词连续存放,
+ * 训练时直接遍历, 不再计算hash.
+ */
+void InitSubwords() {
+  long long a, b, n, total = 0, cap = vocab_size * 8;
+  int *ngrams = (int *)malloc((MAX_STRING + 2) * (subword_maxn - subword_minn + 1) * sizeof(int));
+
+  if (vocab_size + subword_buckets > 0x7FFFFFFF) {
+    printf("ERROR: vocabulary plus -subword-buckets exceeds %d rows\n", 0x7FFFFFFF);
     exit(1);
   }
-  fseek(fin, 0, SEEK_END);
-  file_size = ftell(fin);
-  fclose(fin);
+  subword_offset = (long long *)malloc((vocab_size + 1) * sizeof(long long));
+  subword_rows = (int *)malloc(cap * sizeof(int));
+  if (ngrams == NULL || subword_offset == NULL || subword_rows == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < vocab_size; a++) {
+    n = WordNgrams(vocab[a].word, ngrams);
+    if (total + n + 1 > cap) {
+      while (total + n + 1 > cap) cap *= 2;
+      subword_rows = (int *)realloc(subword_rows, cap * sizeof(int));
+      if (subword_rows == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    }
+    subword_offset[a] = total;
+    subword_rows[total++] = (int)a;
+    for (b = 0; b < n; b++) subword_rows[total++] = (int)(vocab_size + ngrams[b]);
+  }
+  subword_offset[vocab_size] = total;
+  subword_rows = (int *)realloc(subword_rows, total * sizeof(int));
+  free(ngrams);
+  if (debug_mode > 0) printf("Subwords: %lld buckets, %.2f input rows per word\n", subword_buckets, total / (double)vocab_size);
+}
+
+/**
+ * 词汇表缓存的文件头. 之后的各段按64字节对齐, 偏移量(字节)记录在头中:
+ *   cn[V], 词在字符串池中的偏移index[V + 1], 字符串池, vocab_hash[2^hash_bits],
+ *   (有编码时) codelen[V], code[∑codelen], point[∑(codelen + 1)],
+ *   (有unigram表时) table[table_size].
+ */
+struct vocab_cache_header {
+  char magic[8];            // "W2VVOCAB"
+  long long version,        // VOCAB_CACHE_VERSION
+       fingerprint,         // 语料指纹, 见CorpusFingerprint()
+       min_count,
+       vocab_size,
+       train_words,
+       hash_bits,           // vocab_hash的容量为2^hash_bits
+       hs_layout,           // 编码对应的hs_layout. -1: 没有编码
+       table_size,          // unigram表的大小. 0: 没有
+       cn_off, index_off, pool_off, hash_off, codelen_off, code_off, point_off, table_off,
+       file_size;
+};
+
+/*
+ * 64位FNV-1a, 从h开始累加n个字节.
+ */
+unsigned long long FingerprintBytes(unsigned long long h, const void *p, long long n) {
+  const unsigned char *b = (const unsigned char *)p;
+  long long a;
+
+  for (a = 0; a < n; a++) h = (h ^ b[a]) * 0x100000001B3ULL;
+  return h;
+}
+
+/*
+ * 语料指纹: 每个文件的路径、大小、修改时间与首尾各一块内容, 再加上整个语料上均匀分布的
+ * FINGERPRINT_SAMPLES块内容. 只读取很少的字节, 但语料被修改、替换或增删文件时都会改变.
+ * 影响词汇表的参数(min_count)也计入.
+ */
+unsigned long long CorpusFingerprint() {
+  unsigned long long h = 0xCBF29CE484222325ULL;
+  char buf[FINGERPRINT_BLOCK];
+  long long a, pos, n, offset;
+  struct stat st;
+  FILE *fin;
+  int f;
+
+  h = FingerprintBytes(h, &min_count, sizeof(min_count));
+  for (f = 0; f < num_corpus_files; f++) {
+    if (stat(corpus_files[f].name, &st) != 0) return 0;
+    h = FingerprintBytes(h, corpus_files[f].name, strlen(corpus_files[f].name) + 1);
+    h = FingerprintBytes(h, &corpus_files[f].size, sizeof(long long));
+    h = FingerprintBytes(h, &st.st_mtim, sizeof(st.st_mtim));
+    fin = fopen(corpus_files[f].name, "rb");
+    if (fin == NULL) return 0;
+    n = fread(buf, 1, FINGERPRINT_BLOCK, fin);
+    h = FingerprintBytes(h, buf, n);
+    if (corpus_files[f].size > FINGERPRINT_BLOCK) {
+      fseek(fin, corpus_files[f].size - FINGERPRINT_BLOCK, SEEK_SET);
+      n = fread(buf, 1, FINGERPRINT_BLOCK, fin);
+      h = FingerprintBytes(h, buf, n);
+    }
+    fclose(fin);
+  }
+
+  // 整个语料(虚拟字节流)上的采样.
+  for (a = 0; a < FINGERPRINT_SAMPLES; a++) {
+    pos = file_size / FINGERPRINT_SAMPLES * a;
+    for (f = 0; f < num_corpus_files - 1 && corpus_files[f + 1].offset <= pos; f++);
+    offset = pos - corpus_files[f].offset;
+    fin = fopen(corpus_files[f].name, "rb");
+    if (fin == NULL) return 0;
+    fseek(fin, offset, SEEK_SET);
+    n = fread(buf, 1, FINGERPRINT_BLOCK, fin);
+    h = FingerprintBytes(h, buf, n);
+    fclose(fin);
+  }
+  return h;
+}
+
+/*
+ * 文件位置*pos补齐到64字节. 失败返回0.
+ */
+int PadCacheSection(FILE *fo, long long *pos) {
+  static const char zero[64] = {0};
+  long long pad = (64 - *pos % 64) % 64;
+
+  *pos += pad;
+  return pad == 0 || fwrite(zero, 1, pad, fo) == (size_t)pad;
+}
+
+/*
+ * 写一段数据并补齐到64字节, 返回这一段的起始偏移. 失败返回-1.
+ */
+long long WriteCacheSection(FILE *fo, const void *p, long long bytes, long long *pos) {
+  long long start = *pos;
+
+  if (bytes > 0 && fwrite(p, 1, bytes, fo) != (size_t)bytes) return -1;
+  *pos += bytes;
+  return PadCacheSection(fo, pos) ? start : -1;
+}
+
+/*
+ * 保存词汇表缓存. 先写临时文件再rename, 并发运行的多个训练不会读到写了一半的缓存.
+ * with_codes: InitNet()已经生成了Huffman编码; unigram表已生成时一并保存. 写失败只打印警告.
+ */
+void SaveVocabCache(int with_codes) {
+  struct vocab_cache_header h;
+  char tmp[MAX_PATH_STRING + 32];
+  long long a, total = 0, pos = 0, *index = (long long *)malloc((vocab_size + 1) * sizeof(long long));
+  long long *cn = (long long *)malloc(vocab_size * sizeof(long long));
+  char *codelen = (char *)malloc(vocab_size);
+  int ok = 1;
+  FILE *fo;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp.%d", vocab_cache_file, (int)getpid());
+  fo = fopen(tmp, "wb");
+  if (fo == NULL || index == NULL || cn == NULL || codelen == NULL) {
+    printf("WARNING: cannot write vocabulary cache %s\n", vocab_cache_file);
+    if (fo != NULL) fclose(fo);
+    free(index); free(cn); free(codelen);
+    return;
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "W2VVOCAB", 8);
+  h.version = VOCAB_CACHE_VERSION;
+  h.fingerprint = CorpusFingerprint();
+  h.min_count = min_count;
+  h.vocab_size = vocab_size;
+  h.train_words = train_words;
+  h.hash_bits = vocab_hash_bits;
+  h.hs_layout = with_codes ? hs_layout : -1;
+  h.table_size = table != NULL ? table_size : 0;
+  for (a = 0; a < vocab_size; a++) {
+    cn[a] = vocab[a].cn;
+    index[a] = total;
+    total += strlen(vocab[a].word) + 1;
+    codelen[a] = with_codes ? vocab[a].codelen : 0;
+  }
+  index[vocab_size] = total;
+
+  // 文件头先占位, 各段写完后再回填偏移.
+  ok &= WriteCacheSection(fo, &h, sizeof(h), &pos) == 0;
+  h.cn_off = WriteCacheSection(fo, cn, vocab_size * sizeof(long long), &pos);
+  h.index_off = WriteCacheSection(fo, index, (vocab_size + 1) * sizeof(long long), &pos);
+  h.pool_off = pos;
+  for (a = 0; a < vocab_size; a++) ok &= fwrite(vocab[a].word, 1, index[a + 1] - index[a], fo) == (size_t)(index[a + 1] - index[a]);
+  pos += total;
+  ok &= PadCacheSection(fo, &pos);
+  h.hash_off = WriteCacheSection(fo, vocab_hash, vocab_hash_size * sizeof(long long), &pos);
+  if (with_codes) {
+    h.codelen_off = WriteCacheSection(fo, codelen, vocab_size, &pos);
+    h.code_off = pos;
+    for (a = 0; a < vocab_size; a++) {
+      ok &= fwrite(vocab[a].code, 1, codelen[a], fo) == (size_t)codelen[a];
+      pos += codelen[a];
+    }
+    ok &= PadCacheSection(fo, &pos);
+    h.point_off = pos;
+    for (a = 0; a < vocab_size; a++) {
+      ok &= fwrite(vocab[a].point, sizeof(int), codelen[a] + 1, fo) == (size_t)(codelen[a] + 1);
+      pos += (codelen[a] + 1) * sizeof(int);
+    }
+    ok &= PadCacheSection(fo, &pos);
+  }
+  if (table != NULL) h.table_off = WriteCacheSection(fo, table, table_size * (long long)sizeof(int), &pos);
+  h.file_size = pos;
+  ok &= h.cn_off >= 0 && h.index_off >= 0 && h.hash_off >= 0 && h.codelen_off >= 0 && h.table_off >= 0;
+  ok &= fseek(fo, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, fo) == 1;
+  ok &= fclose(fo) == 0;
+  if (ok) ok = rename(tmp, vocab_cache_file) == 0;
+  if (!ok) {
+    unlink(tmp);
+    printf("WARNING: cannot write vocabulary cache %s\n", vocab_cache_file);
+  } else if (debug_mode > 0) printf("Saved vocabulary cache %s\n", vocab_cache_file);
+  free(index);
+  free(cn);
+  free(codelen);
+}
+
+/*
+ * 缓存中的一段[off, off + bytes)是否完整地落在大小为size的文件内, 且起始偏移按align字节对齐.
+ */
+int CacheSectionValid(long long off, long long bytes, long long size, long long align) {
+  return off >= 0 && bytes >= 0 && off <= size && bytes <= size - off && off % align == 0;
+}
+
+/*
+ * 检查映射的缓存m(大小为size)的各段是否在文件内, 以及其中的下标是否越界. 截断或部分写入的文件
+ * 也可能有一致的指纹, 不检查就会访问映射之外的内存. 返回0时由调用者丢弃缓存并重新统计.
+ */
+int VocabCacheValid(char *m, long long size) {
+  struct vocab_cache_header *h = (struct vocab_cache_header *)m;
+  long long a, b, v = h->vocab_size, *index, *hash, code_total = 0, point_total = 0;
+  char *codelen;
+  int *point, *tbl;
+
+  // 1. 各计数本身: 词数不可能超过文件大小, hash表容量必须大于词数(否则线性探测不会终止).
+  if (v < 0 || v > size || h->train_words < 0 || h->hash_bits < 1 || h->hash_bits > 40 ||
+      (1LL << h->hash_bits) <= v || h->table_size < 0 || h->table_size > size) return 0;
+
+  // 2. 词频、字符串下标和字符串: 下标单调, 最后一项为字符串区的大小, 每个词以0结尾.
+  if (!CacheSectionValid(h->cn_off, v * (long long)sizeof(long long), size, sizeof(long long)) ||
+      !CacheSectionValid(h->index_off, (v + 1) * (long long)sizeof(long long), size, sizeof(long long))) return 0;
+  index = (long long *)(m + h->index_off);
+  if (index[0] != 0 || !CacheSectionValid(h->pool_off, index[v], size, 1)) return 0;
+  for (a = 0; a < v; a++)
+    if (index[a + 1] <= index[a] || index[a + 1] > index[v] || m[h->pool_off + index[a + 1] - 1] != 0) return 0;
+
+  // 3. hash表: 每项为-1或词的下标.
+  if (!CacheSectionValid(h->hash_off, (1LL << h->hash_bits) * (long long)sizeof(long long), size, sizeof(long long))) return 0;
+  hash = (long long *)(m + h->hash_off);
+  for (a = 0; a < (1LL << h->hash_bits); a++) if (hash[a] < -1 || hash[a] >= v) return 0;
+
+  // 4. Huffman编码: 编码长度 < MAX_CODE_LENGTH(point还有末尾的叶子), 路径上的内部节点是syn1的行.
+  if (h->hs_layout >= 0) {
+    if (!CacheSectionValid(h->codelen_off, v, size, 1)) return 0;
+    codelen = m + h->codelen_off;
+    for (a = 0; a < v; a++) {
+      if (codelen[a] < 0 || codelen[a] >= MAX_CODE_LENGTH) return 0;
+      code_total += codelen[a];
+      point_total += codelen[a] + 1;
+    }
+    if (!CacheSectionValid(h->code_off, code_total, size, 1) ||
+        !CacheSectionValid(h->point_off, point_total * (long long)sizeof(int), size, sizeof(int))) return 0;
+    point = (int *)(m + h->point_off);
+    for (a = 0; a < v; a++) {
+      for (b = 0; b < codelen[a]; b++) if (point[b] < 0 || point[b] >= v - 1) return 0;
+      point += codelen[a] + 1;
+    }
+  }
+
+  // 5. unigram表: 每项为词的下标.
+  if (h->table_size > 0) {
+    if (!CacheSectionValid(h->table_off, h->table_size * (long long)sizeof(int), size, sizeof(int))) return 0;
+    tbl = (int *)(m + h->table_off);
+    for (a = 0; a < h->table_size; a++) if (tbl[a] < 0 || tbl[a] >= v) return 0;
+  }
+  return 1;
+}
+
+/*
+ * 读取词汇表缓存: 文件不存在、版本或语料指纹/min_count不一致时返回0(由调用者重新统计并保存).
+ * 整个文件以MAP_PRIVATE映射, 词、hash表、编码和unigram表直接指向映射的内存, 只有vocab数组需要填写.
+ * 缓存中没有同样hs_layout的编码, 或者需要而没有unigram表时照常生成, 之后重新保存缓存.
+ */
+int LoadVocabCache() {
+  struct vocab_cache_header *h;
+  struct stat st;
+  long long a, *index, code_pos = 0, point_pos = 0;
+  char *m, *codelen;
+  int fd = open(vocab_cache_file, O_RDONLY);
+
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) != 0 || st.st_size < (long long)sizeof(struct vocab_cache_header)) {close(fd); return 0;}
+  m = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) return 0;
+  h = (struct vocab_cache_header *)m;
+  if (memcmp(h->magic, "W2VVOCAB", 8) || h->version != VOCAB_CACHE_VERSION || h->file_size != st.st_size ||
+      h->min_count != min_count || h->fingerprint != (long long)CorpusFingerprint()) {
+    munmap(m, st.st_size);
+    return 0;
+  }
+  if (!VocabCacheValid(m, st.st_size)) {
+    printf("WARNING: vocabulary cache %s is corrupt, rebuilding it\n", vocab_cache_file);
+    munmap(m, st.st_size);
+    return 0;
+  }
+
+  // 词汇表: 词与词频.
+  vocab_size = h->vocab_size;
+  vocab_max_size = vocab_size + 1;
+  vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+  if (vocab == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  index = (long long *)(m + h->index_off);
+  for (a = 0; a < vocab_size; a++) {
+    vocab[a].cn = ((long long *)(m + h->cn_off))[a];
+    vocab[a].word = m + h->pool_off + index[a];
+  }
+  train_words = h->train_words;
+  free(vocab_hash);
+  vocab_hash = (long long *)(m + h->hash_off);
+  vocab_hash_bits = h->hash_bits;
+  vocab_hash_size = 1LL << vocab_hash_bits;
+
+  // Huffman编码: 缓存中有同样layout的编码时直接使用, 否则分配后在InitNet()中生成(之后重新保存缓存).
+  vocab_cache_codes = h->hs_layout >= 0 && h->hs_layout == hs_layout;
+  codelen = m + h->codelen_off;
+  if (vocab_cache_codes) {
+    for (a = 0; a < vocab_size; a++) {
+      vocab[a].codelen = codelen[a];
+      vocab[a].code = m + h->code_off + code_pos;
+      vocab[a].point = (int *)(m + h->point_off) + point_pos;
+      code_pos += codelen[a];
+      point_pos += codelen[a] + 1;
+    }
+  } else AllocVocabCodes();
+
+  // unigram表.
+  vocab_cache_table = h->table_size == table_size;
+  if (vocab_cache_table) table = (int *)(m + h->table_off);
+
+  vocab_cache_save = !vocab_cache_codes || (negative > 0 && !vocab_cache_table);
+  if (debug_mode > 0) {
+    printf("Loaded vocabulary cache %s%s%s\n", vocab_cache_file, vocab_cache_codes ? " (with Huffman codes)" : "",
+           vocab_cache_table ? " (with unigram table)" : "");
+    printf("Vocab size: %lld\n", vocab_size);
+    printf("Words in train file: %lld\n", train_words);
+  }
+  return 1;
 }
 
 /**
@@ -625,9 +1930,10 @@ void ReadVocab() {
 void InitNet() {
   long long a, b;
   unsigned long long next_random = 1;
+  double t;
 
-  // a = vocab_size*layer_size*sizeof(real): 按128字节，数据对齐
-  a = posix_memalign((void **)&syn0, 128, (long long)vocab_size * layer1_size * sizeof(real));
+  // a = vocab_size*layer_size*sizeof(real): 按128字节，数据对齐. 使用子词时后面还有subword_buckets行.
+  a = posix_memalign((void **)&syn0, 128, (long long)(vocab_size + subword_buckets) * layer1_size * sizeof(real));
   
   // syn0
   if (syn0 == NULL) {printf("Memory allocation failed\n"); exit(1);}
@@ -658,459 +1964,2520 @@ void InitNet() {
 
   // 初始化syn0矩阵, vocab_size x layer1_size, 随机分配权重
   // 权重大小范围：(-0.5/layer_size, 0.5/layer1_size) 
-  for (a = 0; a < vocab_size; a++) 
+  for (a = 0; a < vocab_size + subword_buckets; a++) 
       for (b = 0; b < layer1_size; b++) {
         next_random = next_random * (unsigned long long)25214903917 + 11;
         syn0[a * layer1_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
       }
 
-  // 创建Huffman二叉树.
-  CreateBinaryTree();
+  if (subword_buckets > 0) InitSubwords();
+
+  // 创建Huffman二叉树(词汇表缓存中已有编码时跳过).
+  t = WallTime();
+  if (!vocab_cache_codes) CreateBinaryTree();
+  phases.tree = WallTime() - t;
 }
 
 /*
- * 训练模型线程.
+ * 行的脏标记: 训练线程每更新一行, 就把该行的stamp写为当前的dirty_epoch.
+ * 使用者(同步、checkpoint)记住自己上次读取时的epoch since, 并调用DirtyAdvance()开始新的区间,
+ * 之后stamp >= since的行即为这段时间内被更新过的行. 多个使用者可以各自记录自己的since.
+ * stamp为NULL(未开启跟踪)时不做任何事.
  */
-void *TrainModelThread(void *id) {
-  long long a, 
-       b, 
-       d, 
-       cw, 
-       word, 
-       last_word, 
-       sentence_length = 0, 
-       sentence_position = 0;
-
-  long long word_count = 0, 
-       last_word_count = 0, 
-       sen[MAX_SENTENCE_LENGTH + 1];
-
-  long long l1, 
-       l2, 
-       c, 
-       target, 
-       label, 
-       local_iter = iter;
+static inline void MarkDirty(unsigned int *stamp, long long row) {
+  if (stamp != NULL) stamp[row] = dirty_epoch;
+}
 
-  // 随机数。将id做为起始值. 
-  unsigned long long next_random = (long long)id;
-  
-  real f, 
-       g;
-  
-  clock_t now;
-  
-  // step 1: 为neu1/neu1e分配内存.
-  real *neu1 = (real *)calloc(layer1_size, sizeof(real));
-  real *neu1e = (real *)calloc(layer1_size, sizeof(real));
-  
-  // step 2: 打开训练文件. 定位到某线程id对应所属的文件段
-  FILE *fi = fopen(train_file, "rb");
-  fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+/*
+ * 本线程读写的syn0/syn1neg行: 在副本范围内(word < rep_rows)时为本线程的副本, 否则为共享矩阵.
+ * 副本中syn0的行在前, syn1neg的行在后.
+ */
+static inline real *Syn0Row(struct thread_scratch *ts, long long word) {
+  if (word < ts->rep_rows) return ts->rep + word * layer1_size;
+  return syn0 + word * layer1_size;
+}
 
-  // step 3: 训练主循环：
-  // 每次读取1000个词到sen[]中，进行训练.
-  //
-  while (1) {
+static inline real *Syn1negRow(struct thread_scratch *ts, long long word) {
+  if (word < ts->rep_rows) return ts->rep + (ts->rep_rows + word) * layer1_size;
+  return syn1neg + word * layer1_size;
+}
 
-    // step 3-1: 更新要处理的word_count, last_word_count.
-    if (word_count - last_word_count > 10000) {
-      word_count_actual += word_count - last_word_count;
-      last_word_count = word_count;
+/*
+ * -subword-buckets: 把词word的输入向量(自身行与n-gram行的平均)加到out上.
+ */
+static inline void AddSubwordInput(real *out, long long word) {
+  const int *rows = subword_rows + subword_offset[word];
+  long long a, c, n = subword_offset[word + 1] - subword_offset[word];
+  real scale = 1.0 / n, *row;
+
+  for (a = 0; a < n; a++) {
+    row = syn0 + (long long)rows[a] * layer1_size;
+    for (c = 0; c < layer1_size; c++) out[c] += row[c] * scale;
+  }
+}
 
-      // a.打印调试信息: 学习率alpha, 进度, 每秒钟每个线程处理words数.
-      if ((debug_mode > 1)) {
-        now=clock();
-        printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha,
-         word_count_actual / (real)(iter * train_words + 1) * 100,
-         word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
-        fflush(stdout);
-      }
-      
-      // b.自适应学习率.
-      alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
-      if (alpha < starting_alpha * 0.0001) {
-          alpha = starting_alpha * 0.0001;
-      }
-    }
-    
-    // step 3-2: 从文件中读取1000个词，组成一个sentence.
-    if (sentence_length == 0) {
-      while (1) {
+/*
+ * -subword-buckets: 把误差neu1e加到词word的每一个输入行上(与word2vec/fastText相同, 不按行数缩放).
+ */
+static inline void UpdateSubwordRows(long long word, const real *neu1e) {
+  const int *rows = subword_rows + subword_offset[word];
+  long long a, c, n = subword_offset[word + 1] - subword_offset[word];
+  real *row;
+
+  for (a = 0; a < n; a++) {
+    row = syn0 + (long long)rows[a] * layer1_size;
+    for (c = 0; c < layer1_size; c++) row[c] += neu1e[c];
+  }
+}
 
-        // a.从文件中读取当前位置的词, 返回在vocab中的索引.  
-        word = ReadWordIndex(fi);
+/*
+ * bf16 -> float: 低16位补0.
+ */
+static inline real Bf16ToFloat(bf16 h) {
+  union {unsigned int u; float f;} v;
+  v.u = (unsigned int)h << 16;
+  return v.f;
+}
 
-        // b.文件末尾，结束
-        if (feof(fi)) break;
+/*
+ * float -> bf16, 随机舍入: 把16位随机数r加到float的低16位上再截断, 进位(即按量级向上舍入)的概率
+ * 等于被截掉部分的比例, 舍入误差的期望为0. 学习率很小时, 单次更新往往小于bf16的精度,
+ * 就近舍入会把它们全部丢掉, 随机舍入则在期望上保留.
+ */
+static inline bf16 FloatToBf16(real x, unsigned int r) {
+  union {unsigned int u; float f;} v;
+  v.f = x;
+  return (bf16)((v.u + (r & 0xFFFF)) >> 16);
+}
 
-        // c.索引不存在，抛弃该词，继续
-        if (word == -1) continue;
+/*
+ * 一行中第c个分量的舍入随机数: 由每行一个的seed和c做整数哈希得到, 没有循环间的依赖, 可以向量化.
+ */
+static inline unsigned int RoundingNoise(unsigned int seed, long long c) {
+  unsigned int r = seed + (unsigned int)c * 0x9E3779B9u;
+  r ^= r >> 16;
+  r *= 0x85EBCA6Bu;
+  return r ^ (r >> 13);
+}
+
+/*
+ * 本线程的下一个行seed.
+ */
+static inline unsigned int RoundingSeed(struct thread_scratch *ts) {
+  ts->round_random = ts->round_random * (unsigned long long)25214903917 + 11;
+  return (unsigned int)(ts->round_random >> 16);
+}
+
+/*
+ * bf16行加到out: out += row.
+ */
+static inline void AccumulateBf16(real *out, bf16 *row) {
+  long long c;
+  for (c = 0; c < layer1_size; c++) out[c] += Bf16ToFloat(row[c]);
+}
 
-        // 自增
-        word_count++;
+/*
+ * bf16行的更新: row += delta, 随机舍入.
+ */
+static inline void AddToBf16(bf16 *row, real *delta, unsigned int seed) {
+  long long c;
+  for (c = 0; c < layer1_size; c++) row[c] = FloatToBf16(Bf16ToFloat(row[c]) + delta[c], RoundingNoise(seed, c));
+}
 
-        // 为0，则结束
-        if (word == 0) break;
+/*
+ * 把float矩阵m(n个元素)转换为bf16(就近舍入), 并释放m. 与InitNet()一样按128字节对齐分配新的矩阵:
+ * realloc()不保证对齐, 而训练循环和预取假定行按128字节对齐.
+ */
+bf16 *ShrinkToBf16(real *m, long long n) {
+  long long a;
+  bf16 *h = NULL;
+
+  if (posix_memalign((void **)&h, 128, n * sizeof(bf16)) != 0) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < n; a++) h[a] = FloatToBf16(m[a], 0x8000);
+  free(m);
+  return h;
+}
 
-        // d.进行subsampling，随机丢弃常见词，保持相同的频率排序ranking.
-        // The subsampling randomly discards frequent words while keeping the ranking same
-        if (sample > 0) {
+/*
+ * ShrinkToBf16()的逆过程: 分配128字节对齐的float矩阵, 转换后释放h.
+ */
+real *GrowToFloat(bf16 *h, long long n) {
+  long long a;
+  real *m = NULL;
+
+  if (posix_memalign((void **)&m, 128, n * sizeof(real)) != 0) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < n; a++) m[a] = Bf16ToFloat(h[a]);
+  free(h);
+  return m;
+}
 
-          // 计算相应的抛弃概率ran.
-          real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
+/*
+ * -bf16: 把InitNet()初始化的syn0/syn1neg转换为bf16, 训练期间只保留bf16矩阵.
+ */
+void InitBf16Storage() {
+  syn0_bf = ShrinkToBf16(syn0, vocab_size * layer1_size);
+  syn0 = NULL;
+  if (negative > 0) {
+    syn1neg_bf = ShrinkToBf16(syn1neg, vocab_size * layer1_size);
+    syn1neg = NULL;
+  }
+}
 
-          // 生成一个随机数next_random.
-          next_random = next_random * (unsigned long long)25214903917 + 11;
+/*
+ * -bf16: 训练结束后转换回float矩阵, 用于保存和评测.
+ */
+void FinishBf16Storage() {
+  syn0 = GrowToFloat(syn0_bf, vocab_size * layer1_size);
+  syn0_bf = NULL;
+  if (negative > 0) {
+    syn1neg = GrowToFloat(syn1neg_bf, vocab_size * layer1_size);
+    syn1neg_bf = NULL;
+  }
+}
 
-          // 如果random/65536 - ran > 0, 则抛弃该词，继续
-          if (ran < (next_random & 0xFFFF) / (real)65536) 
-              continue;
-        }
+/*
+ * 为syn0/syn1/syn1neg分配行的stamp数组(初始为0, 即未更新), 开启脏标记跟踪.
+ */
+void InitDirtyTracking() {
+  syn0_stamp = (unsigned int *)calloc(vocab_size, sizeof(unsigned int));
+  if (hs) syn1_stamp = (unsigned int *)calloc(vocab_size, sizeof(unsigned int));
+  if (negative > 0) syn1neg_stamp = (unsigned int *)calloc(vocab_size, sizeof(unsigned int));
+}
+
+/*
+ * 开始一个新的区间, 返回新的epoch. 此后被更新的行的stamp >= 返回值.
+ */
+unsigned int DirtyAdvance() {
+  return __atomic_add_fetch(&dirty_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * 列出stamp >= since的行号, 写入rows, 返回行数. since为0时列出所有行.
+ *
+ * 训练线程先读dirty_epoch再写stamp, 中间使用者可能已经开始了新的区间, 这样的行会带着
+ * 上一个epoch的stamp. 所以使用者应传入上一次的since - 1, 多包含一个区间; 同步和checkpoint
+ * 发送的都是行的当前值(或相对基准的增量), 多包含的行只多占一点空间, 不影响结果.
+ */
+long long DirtyRows(unsigned int *stamp, unsigned int since, int *rows) {
+  long long a, n = 0;
+  for (a = 0; a < vocab_size; a++) 
+      if (stamp[a] >= since) rows[n++] = a;
+  return n;
+}
+
+/*
+ * 把矩阵m中rows列出的n行(base不为NULL时为m - base)依次复制到out, 用于序列化.
+ */
+void PackRows(real *m, real *base, int *rows, long long n, real *out) {
+  long long a, c, l;
+  for (a = 0; a < n; a++) {
+    l = (long long)rows[a] * layer1_size;
+    if (base == NULL) memcpy(out + a * layer1_size, m + l, layer1_size * sizeof(real));
+    else for (c = 0; c < layer1_size; c++) out[a * layer1_size + c] = m[l + c] - base[l + c];
+  }
+}
+
+/*
+ * 把rows列出的n行写入文件: 矩阵编号id, 行数n, 行号, 各行的值.
+ */
+void WriteRows(FILE *fo, int id, real *m, int *rows, long long n, real *buf) {
+  fwrite(&id, sizeof(int), 1, fo);
+  fwrite(&n, sizeof(long long), 1, fo);
+  fwrite(rows, sizeof(int), n, fo);
+  PackRows(m, NULL, rows, n, buf);
+  fwrite(buf, sizeof(real), n * layer1_size, fo);
+}
+
+/*
+ * 对sen[from, to)中的词做subsampling, 把保留的词压缩到sen[from, ...)中, 返回新的长度.
+ *
+ * 分三步, 每一步都是无分支的循环: 生成随机数, 查保留阈值表比较, 压缩.
+ */
+long long SubsampleSentence(long long *sen, long long from, long long to, unsigned long long *next_random) {
+  unsigned long long rnd[MAX_SENTENCE_LENGTH];
+  unsigned char keep[MAX_SENTENCE_LENGTH];
+  long long a, n = to - from;
+
+  // a.生成随机数.
+  for (a = 0; a < n; a++) {
+    *next_random = *next_random * (unsigned long long)25214903917 + 11;
+    rnd[a] = *next_random;
+  }
+
+  // b.随机数的低16位 < 保留阈值, 则保留.
+  for (a = 0; a < n; a++) 
+      keep[a] = (rnd[a] & 0xFFFF) < keep_threshold[sen[from + a]];
+
+  // c.压缩.
+  n = from;
+  for (a = from; a < to; a++) {
+    sen[n] = sen[a];
+    n += keep[a - from];
+  }
+  return n;
+}
+
+/*
+ * 从读取器r中读取一个句子(最长MAX_SENTENCE_LENGTH个词, 遇到</s>结束),
+ * 并对常见词做subsampling. 返回句子长度; word_count累加读取的词数.
+ *
+ * 先读入一批词的索引, 再对整批做subsampling; 句子未满时继续读下一批.
+ */
+long long ReadSentence(struct corpus_reader *r, long long *sen, long long *word_count, unsigned long long *next_random) {
+  long long word, n, sentence_length = 0;
+  int end = 0;
 
-        // e.将该词添加到句子sen中.最大长度1000.
-        sen[sentence_length] = word;
-        sentence_length++;
+  while (!end && (sentence_length < MAX_SENTENCE_LENGTH)) {
+    n = sentence_length;
+    while (n < MAX_SENTENCE_LENGTH) {
 
-        if (sentence_length >= MAX_SENTENCE_LENGTH) 
-            break;
+      // a.从文件中读取当前位置的词, 返回在vocab中的索引.  
+      word = ReadWordIndex(r);
+
+      // b.分片末尾，结束
+      if (r->eof) {
+        end = 1;
+        break;
       }
-      
-      sentence_position = 0;
+
+      // c.索引不存在，抛弃该词，继续
+      if (word == -1) continue;
+
+      // 自增
+      (*word_count)++;
+
+      // 为0，则结束
+      if (word == 0) {
+        end = 1;
+        break;
+      }
+
+      // d.将该词添加到句子sen中.最大长度1000.
+      sen[n] = word;
+      n++;
     }
 
-    // step 3-3: 如果到达文件末尾，或者word_count超过每个线程的train_words数，重新定位文件指针.
-    if (feof(fi) || (word_count > train_words / num_threads)) {
+    // e.进行subsampling，随机丢弃常见词，保持相同的频率排序ranking.
+    // The subsampling randomly discards frequent words while keeping the ranking same
+    if (sample > 0) 
+        sentence_length = SubsampleSentence(sen, sentence_length, n, next_random);
+    else 
+        sentence_length = n;
+  }
 
-      // a.更新 word_count_actual 
-      word_count_actual += word_count - last_word_count;
-      
-      // b.更新 local_iter.
-      local_iter--;
-      if (local_iter == 0) 
-          break;
+  return sentence_length;
+}
 
-      // c.重置0.
-      word_count = 0;
-      last_word_count = 0;
-      sentence_length = 0;
+/*
+ * 生产者: 等待队列q有空位, 返回可写入的批次. 等待期间训练提前停止时返回NULL.
+ */
+struct sentence_batch *QueueReserve(struct sentence_queue *q) {
+  double t;
+  if (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) < QUEUE_SIZE) 
+      return &q->batch[q->tail % QUEUE_SIZE];
+  t = WallTime();
+  while (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= QUEUE_SIZE) {
+    if (__atomic_load_n(&stop_training, __ATOMIC_ACQUIRE)) return NULL;
+    sched_yield();
+  }
+  q->full_wait += WallTime() - t;
+  return &q->batch[q->tail % QUEUE_SIZE];
+}
+
+/*
+ * 生产者: 发布QueueReserve()返回的批次.
+ */
+void QueuePush(struct sentence_queue *q) {
+  __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * 消费者: 等待并返回队首批次. 批次在QueuePop()之前一直有效. 等待期间训练提前停止时返回NULL.
+ */
+struct sentence_batch *QueueFront(struct sentence_queue *q) {
+  double t;
+  if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) > q->head) 
+      return &q->batch[q->head % QUEUE_SIZE];
+  t = WallTime();
+  while (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) <= q->head) {
+    if (__atomic_load_n(&stop_training, __ATOMIC_ACQUIRE)) return NULL;
+    sched_yield();
+  }
+  q->empty_wait += WallTime() - t;
+  return &q->batch[q->head % QUEUE_SIZE];
+}
+
+/*
+ * 消费者: 释放队首批次.
+ */
+void QueuePop(struct sentence_queue *q) {
+  __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * 读取线程: 负责训练线程id, id + num_readers, ... 的语料分片.
+ * 轮流为各个分片读取句子, 写入对应训练线程的队列; 每个分片读完一轮时,
+ * 写入一个end_of_shard批次, 共iter轮.
+ */
+void *ReaderThread(void *id) {
+  long long a, n = 0, active, start_pos, end_pos;
+  long long *shard = (long long *)malloc(num_threads * sizeof(long long));
+  long long *local_iter = (long long *)malloc(num_threads * sizeof(long long));
+  unsigned long long *next_random = (unsigned long long *)malloc(num_threads * sizeof(unsigned long long));
+  struct corpus_reader *reader = (struct corpus_reader *)malloc(num_threads * sizeof(struct corpus_reader));
+  struct sentence_batch *batch;
+
+  // 打开负责的各个分片. 每个分片的随机数起始值与非流水线模式一样, 取训练线程id.
+  for (a = (long long)id; a < num_threads; a += num_readers) {
+    shard[n] = a;
+    local_iter[n] = iter;
+    next_random[n] = a;
+    ShardRange(worker_id * num_threads + a, num_workers > 1 ? num_workers * num_threads : num_threads, &start_pos, &end_pos);
+    ReaderOpen(&reader[n], start_pos, end_pos);
+    n++;
+  }
+
+  active = n;
+  while (active > 0) {
+    for (a = 0; a < n; a++) {
+      if (local_iter[a] == 0) continue;
+
+      batch = QueueReserve(&queues[shard[a]]);
+      if (batch == NULL) {
+        active = 0;
+        break;
+      }
+      batch->word_count = 0;
+      batch->length = ReadSentence(&reader[a], batch->sen, &batch->word_count, &next_random[a]);
+      batch->end_of_shard = reader[a].eof;
+      QueuePush(&queues[shard[a]]);
+
+      // 分片读完一轮.
+      if (reader[a].eof) {
+        local_iter[a]--;
+        if (local_iter[a] == 0) {
+          ReaderClose(&reader[a]);
+          active--;
+        } else ReaderRewind(&reader[a]);
+      }
+    }
+  }
+  for (a = 0; a < n; a++) 
+      if (local_iter[a] > 0) ReaderClose(&reader[a]);
+
+  free(shard);
+  free(local_iter);
+  free(next_random);
+  free(reader);
+  pthread_exit(NULL);
+}
+
+/*
+ * 损失项-log(sigmoid(x)), 查logSigTable. 超出(-MAX_EXP, MAX_EXP)时: 取0或-x.
+ */
+static inline real NegLogSigmoid(real x) {
+  if (x >= MAX_EXP) return 0;
+  if (x <= -MAX_EXP) return -x;
+  return logSigTable[(int)((x + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
+}
+
+/*
+ * 所有训练线程的损失, 返回自上次调用以来每个样本的平均损失.
+ * prev_loss/prev_examples保存上次调用时的累计值.
+ */
+double IntervalLoss(double *prev_loss, long long *prev_examples) {
+  long long a, examples = 0;
+  double loss = 0, avg;
+
+  for (a = 0; a < num_threads; a++) {
+    loss += stats[a].loss;
+    examples += stats[a].loss_examples;
+  }
+  avg = (loss - *prev_loss) / (examples - *prev_examples + (examples == *prev_examples));
+  *prev_loss = loss;
+  *prev_examples = examples;
+  return avg;
+}
 
-      // d.重置文件指针，进行下一轮迭代.
-      fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+/*
+ * 批量计算logistic函数: p[d] = 1 / (1 + e^-f[d]), d ∈ [0, n).
+ *
+ * 缺省使用sigmoid.h中可向量化的多项式近似;
+ * -exp-table 1时查原来的expTable表, 超出(-MAX_EXP, MAX_EXP)的部分取0或1.
+ */
+void Logistic(real *f, real *p, long long n) {
+  long long d;
+
+  if (!exp_table) {
+    SigmoidBatch(f, p, n);
+    return;
+  }
+
+  for (d = 0; d < n; d++) {
+    if (f[d] > MAX_EXP) p[d] = 1;
+    else if (f[d] < -MAX_EXP) p[d] = 0;
+    else p[d] = expTable[(int)((f[d] + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
+  }
+}
+
+/*
+ * 预取一行(bytes字节)到cache: 每个cache line(64字节)发一次预取. -prefetch 0时不预取.
+ */
+static inline void PrefetchRow(const void *row, long long bytes) {
+  long long c;
+  if (!prefetch) return;
+  for (c = 0; c < bytes; c += 64) __builtin_prefetch((const char *)row + c);
+}
+
+/*
+ * 层次softmax(Hierarchical Softmax):
+ *    输入向量in(cbow: neu1; skip-gram: 上下文词在syn0中的行), 沿word的Huffman
+ *    路径, 用logistic regression预测每一位编码. 更新syn1, 误差累加到neu1e.
+ *
+ * 路径上各节点的logit只依赖in和各自的syn1行(互不相同), 因此先批量算出
+ * 全部logit和sigmoid, 再逐个节点更新.
+ */
+void TrainHierarchicalSoftmax(real *in, real *neu1e, long long word, struct thread_scratch *ts) {
+  long long c, d, l2, n = vocab[word].codelen;
+  real loss = 0;
+
+  // a.前向传播: f = ∑ in*syn1
+  //    l2: 当前节点号 * 隐单元数，用于索引syn1权重.
+  //    syn1的size: vocab_size x layer1_size, 每个内部节点对应一个layer1_size的向量.
+  // Propagate hidden -> output
+  for (d = 0; d < n; d++) {
+    l2 = vocab[word].point[d] * layer1_size;
+    if (d + 1 < n) PrefetchRow(syn1 + vocab[word].point[d + 1] * layer1_size, layer1_size * sizeof(real));
+    ts->f[d] = 0;
+    for (c = 0; c < layer1_size; c++) ts->f[d] += in[c] * syn1[c + l2];
+  }
+
+  // b.再由f值作logistic regression计算，得到一个概率值
+  Logistic(ts->f, ts->p, n);
+
+  //   损失: 编码为0的节点标签为1, 损失为-log σ(f); 编码为1时为-log σ(-f).
+  for (d = 0; d < n; d++) loss += NegLogSigmoid(vocab[word].code[d] ? -ts->f[d] : ts->f[d]);
+  ts->stats->loss += loss;
+
+  // c.lr预测的概率(为1的概率), 与真实编码的反面的差. 即梯度.
+  //   与原实现一致: f超出(-MAX_EXP, MAX_EXP)的节点不更新.
+  // 'g' is the gradient multiplied by the learning rate
+  for (d = 0; d < n; d++) {
+    ts->g[d] = (1 - vocab[word].code[d] - ts->p[d]) * alpha;
+    if (ts->f[d] <= -MAX_EXP || ts->f[d] >= MAX_EXP) ts->g[d] = 0;
+  }
+
+  ts->stats->hs_steps += n;
+  for (d = 0; d < n; d++) {
+    if (ts->g[d] == 0) {
+      ts->stats->hs_skipped++;
+      continue;
+    }
+    l2 = vocab[word].point[d] * layer1_size;
+
+    // d.反向传播: neu1e = ∑ g*syn1
+    // Propagate errors output -> hidden
+    for (c = 0; c < layer1_size; c++) neu1e[c] += ts->g[d] * syn1[c + l2];
+
+    // e.更新syn1: syn1 += g*in
+    // Learn weights hidden -> output
+    for (c = 0; c < layer1_size; c++) syn1[c + l2] += ts->g[d] * in[c];
+    MarkDirty(syn1_stamp, vocab[word].point[d]);
+  }
+}
+
+/*
+ * 负采样(NEGATIVE SAMPLING):
+ *    1个label=1的样本：       (word->word自身)
+ *    negative个label=0的样本: (word->从unigram表中随机抽取的其它词)
+ *    使用logistic regression来近似softmax. 更新syn1neg, 误差累加到neu1e.
+ *
+ * 先抽取全部目标词, 批量算出logit和sigmoid, 再逐个更新.
+ */
+void TrainNegativeSampling(real *in, real *neu1e, long long word, unsigned long long *next_random, struct thread_scratch *ts) {
+  long long c, d, l2, target, n = 0;
+  real loss, *row, w;
+  unsigned int seed;
+
+  // a.抽取目标词. target[0]为正样本, 其余为负样本(抽到word本身则跳过).
+  ts->target[n++] = word;
+  for (d = 1; d < negative + 1; d++) {
+    *next_random = *next_random * (unsigned long long)25214903917 + 11;
+    target = table[(*next_random >> 16) % table_size];
+    if (target == 0) target = *next_random % (vocab_size - 1) + 1;
+    if (target == word) continue;
+    ts->target[n++] = target;
+  }
+
+  ts->stats->neg_samples += n - 1;
+  ts->stats->neg_skipped += negative + 1 - n;
+
+  //   目标行在syn1neg中随机分布, 几乎每行都是一次cache miss: 先一起发出预取, 使它们重叠.
+  for (d = 0; d < n; d++) {
+    if (syn1neg_bf != NULL) PrefetchRow(syn1neg_bf + ts->target[d] * layer1_size, layer1_size * sizeof(bf16));
+    else PrefetchRow(Syn1negRow(ts, ts->target[d]), layer1_size * sizeof(real));
+  }
+
+  // b.前向传播: f = ∑ in*syn1neg. 热点行还要加上本线程尚未合并的累积更新.
+  for (d = 0; d < n; d++) {
+    l2 = ts->target[d] * layer1_size;
+    ts->f[d] = 0;
+    if (syn1neg_bf != NULL) {
+      for (c = 0; c < layer1_size; c++) ts->f[d] += in[c] * Bf16ToFloat(syn1neg_bf[c + l2]);
+      continue;
+    }
+    row = Syn1negRow(ts, ts->target[d]);
+    for (c = 0; c < layer1_size; c++) ts->f[d] += in[c] * row[c];
+    if (ts->hot_acc != NULL && ts->target[d] < hot_rows) 
+        for (c = 0; c < layer1_size; c++) ts->f[d] += in[c] * ts->hot_acc[c + l2];
+  }
+
+  // c.计算logistic的概率, 并得到梯度g = (label - p) * alpha
+  Logistic(ts->f, ts->p, n);
+  ts->g[0] = (1 - ts->p[0]) * alpha;
+
+  //   损失: -log σ(f[0]) - ∑ log σ(-f[d])
+  loss = NegLogSigmoid(ts->f[0]);
+  for (d = 1; d < n; d++) loss += NegLogSigmoid(-ts->f[d]);
+  ts->stats->loss += loss;
+  for (d = 1; d < n; d++) ts->g[d] = -ts->p[d] * alpha;
+
+  for (d = 0; d < n; d++) {
+    l2 = ts->target[d] * layer1_size;
+
+    // 热点行: 更新累积到本线程的缓冲区, 由FlushHotRows()合并.
+    if (ts->hot_acc != NULL && ts->target[d] < hot_rows) {
+      for (c = 0; c < layer1_size; c++) neu1e[c] += ts->g[d] * (syn1neg[c + l2] + ts->hot_acc[c + l2]);
+      for (c = 0; c < layer1_size; c++) ts->hot_acc[c + l2] += ts->g[d] * in[c];
+      if (!ts->hot_used[ts->target[d]]) {
+        ts->hot_used[ts->target[d]] = 1;
+        ts->hot_pending[ts->hot_n++] = ts->target[d];
+      }
+      continue;
+    }
+
+    // bf16存储: 同样先更新neu1e, 再更新syn1neg(随机舍入).
+    if (syn1neg_bf != NULL) {
+      seed = RoundingSeed(ts);
+      w = ts->g[d];
+      for (c = 0; c < layer1_size; c++) neu1e[c] += w * Bf16ToFloat(syn1neg_bf[c + l2]);
+      for (c = 0; c < layer1_size; c++) 
+          syn1neg_bf[c + l2] = FloatToBf16(Bf16ToFloat(syn1neg_bf[c + l2]) + w * in[c], RoundingNoise(seed, c));
+      MarkDirty(syn1neg_stamp, ts->target[d]);
       continue;
     }
 
-    // step 3-4: 获得句首词
-    word = sen[sentence_position];
-    if (word == -1) 
-        continue;
+    // d.使用g 更新neu1e
+    row = Syn1negRow(ts, ts->target[d]);
+    for (c = 0; c < layer1_size; c++) neu1e[c] += ts->g[d] * row[c];
+
+    // e.使用g 更新syn1neg(副本中的行由MergeReplicas()标记)
+    for (c = 0; c < layer1_size; c++) row[c] += ts->g[d] * in[c];
+    if (ts->target[d] >= ts->rep_rows) MarkDirty(syn1neg_stamp, ts->target[d]);
+  }
+}
+
+/*
+ * 把本线程热点行的累积更新合并到syn1neg. 按分区加锁, 从第id个分区开始轮转,
+ * 使各线程同一时刻尽量在不同的分区上合并.
+ */
+void FlushHotRows(struct thread_scratch *ts, long long id) {
+  long long a, c, q, p, r;
+
+  if (ts->hot_n == 0) return;
+  for (q = 0; q < neg_partitions; q++) {
+    p = (id + q) % neg_partitions;
+    pthread_mutex_lock(&neg_locks[p]);
+    for (a = 0; a < ts->hot_n; a++) {
+      r = ts->hot_pending[a];
+      if (r % neg_partitions != p) continue;
+      for (c = 0; c < layer1_size; c++) {
+        syn1neg[r * layer1_size + c] += ts->hot_acc[r * layer1_size + c];
+        ts->hot_acc[r * layer1_size + c] = 0;
+      }
+      MarkDirty(syn1neg_stamp, r);
+    }
+    pthread_mutex_unlock(&neg_locks[p]);
+  }
+  for (a = 0; a < ts->hot_n; a++) ts->hot_used[ts->hot_pending[a]] = 0;
+  ts->hot_n = 0;
+}
+
+/*
+ * 把本线程副本相对上次合并的增量加到共享的syn0/syn1neg, 再用共享矩阵的当前值(含其它线程
+ * 已合并的增量)刷新副本. 与Hogwild一样不加锁: 合并很少发生, 偶尔丢失的增量可以忽略.
+ */
+void MergeReplicas(struct thread_scratch *ts) {
+  long long a, c, k, l, changed;
+  real *m, *local, *base, delta;
+
+  for (k = 0; k < (negative > 0 ? 2 : 1); k++) {
+    m = k ? syn1neg : syn0;
+    for (a = 0; a < ts->rep_rows; a++) {
+      l = a * layer1_size;
+      local = ts->rep + k * ts->rep_rows * layer1_size + l;
+      base = ts->rep_base + k * ts->rep_rows * layer1_size + l;
+      changed = 0;
+      for (c = 0; c < layer1_size; c++) {
+        delta = local[c] - base[c];
+        if (delta != 0) {
+          m[l + c] += delta;
+          changed = 1;
+        }
+        local[c] = base[c] = m[l + c];
+      }
+      if (changed) MarkDirty(k ? syn1neg_stamp : syn0_stamp, a);
+    }
+  }
+  ts->rep_merged = ts->stats->words_read;
+  ts->stats->merges++;
+}
+
+/*
+ * 提前停止: 所有线程读取的词数每过一轮(train_words个词), 由最先发现的线程统计这一轮的平均损失.
+ * 相对上一轮的下降小于early_stop, 且剩余的轮数多于一轮时, 进入最后一轮:
+ * 学习率从当前值在train_words个词内线性降到0, 之后停止训练.
+ */
+void CheckLossPlateau() {
+  long long epoch = word_count_actual / (train_words + 1);
+  double loss;
+
+  if (epoch <= loss_epoch || stop_words > 0) return;
+  pthread_mutex_lock(&epoch_mutex);
+  if (epoch > loss_epoch && stop_words == 0) {
+    loss_epoch = epoch;
+    loss = IntervalLoss(&epoch_loss_prev, &epoch_examples_prev);
+    if (debug_mode > 0) printf("\nEpoch %lld: loss %.5f\n", epoch, loss);
+    if (epoch > 1 && (epoch_loss - loss) < early_stop * epoch_loss && epoch < iter - 1) {
+      stop_start = word_count_actual;
+      stop_alpha = alpha;
+      __atomic_store_n(&stop_words, word_count_actual + train_words, __ATOMIC_RELEASE);
+      if (debug_mode > 0) 
+          printf("Loss plateau (%.5f -> %.5f): decaying alpha from %f over one final epoch\n", epoch_loss, loss, alpha);
+    }
+    epoch_loss = loss;
+  }
+  pthread_mutex_unlock(&epoch_mutex);
+}
+
+/*
+ * 确定性训练: 等待轮到线程id.
+ *
+ * Hogwild中各线程无锁地并发更新syn0/syn1/syn1neg和word_count_actual/alpha,
+ * 结果依赖于线程调度. 确定性模式下, 各线程的分片和随机数种子本来就是固定的,
+ * 只需让所有对共享状态的读写按固定顺序发生: 线程0处理一个句子, 然后线程1,
+ * ..., 然后再回到线程0. 已结束的线程退出轮转.
+ */
+void AcquireTurn(long long id) {
+  pthread_mutex_lock(&turn_mutex);
+  while (turn != id) pthread_cond_wait(&turn_cond, &turn_mutex);
+  pthread_mutex_unlock(&turn_mutex);
+}
+
+/*
+ * 确定性训练: 线程id处理完一个句子, 把轮次交给下一个未结束的线程.
+ * finished为1时线程id退出轮转.
+ */
+void ReleaseTurn(long long id, int finished) {
+  long long a;
+
+  pthread_mutex_lock(&turn_mutex);
+  if (finished) turn_active[id] = 0;
+  for (a = 1; a <= num_threads; a++) 
+      if (turn_active[(id + a) % num_threads]) break;
+  turn = (id + a) % num_threads;
+  pthread_cond_broadcast(&turn_cond);
+  pthread_mutex_unlock(&turn_mutex);
+}
+
+/*
+ * 计算一个矩阵的64位FNV-1a校验和, 用于比较两次训练的结果是否逐位相同.
+ */
+unsigned long long Checksum(real *m, long long n) {
+  unsigned long long hash = 14695981039346656037ULL;
+  unsigned char *p = (unsigned char *)m;
+  long long a;
+
+  if (m == NULL) return 0;
+  for (a = 0; a < n * (long long)sizeof(real); a++) {
+    hash ^= p[a];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/*
+ * 训练模型线程.
+ */
+void *TrainModelThread(void *id) {
+  long long a, 
+       b, 
+       cw, 
+       word, 
+       last_word, 
+       sentence_length = 0, 
+       sentence_position = 0;
+
+  long long word_count = 0, 
+       last_word_count = 0, 
+       sen_buf[MAX_SENTENCE_LENGTH + 1],
+       *sen = sen_buf;
+
+  long long c, 
+       local_iter = iter,
+       start_pos,
+       end_pos;
+
+  int end_of_shard = 0,
+      have_turn = 0;
+
+  // 随机数。将id做为起始值. 
+  unsigned long long next_random = (long long)id;
+  real *row;
+  
+  // 计时: last为上次取句子结束的时刻.
+  double now, last = WallTime();
+
+  struct corpus_reader reader;
+  struct sentence_queue *queue = NULL;
+  struct sentence_batch *batch = NULL;
+  
+  // step 1: 为neu1/neu1e分配内存.
+  real *neu1 = (real *)calloc(layer1_size, sizeof(real));
+  real *neu1e = (real *)calloc(layer1_size, sizeof(real));
+
+  // 批量计算logit的工作区.
+  struct thread_scratch ts;
+  c = (negative + 1 > MAX_CODE_LENGTH) ? negative + 1 : MAX_CODE_LENGTH;
+  ts.target = (long long *)malloc(c * sizeof(long long));
+  ts.f = (real *)malloc(c * sizeof(real));
+  ts.p = (real *)malloc(c * sizeof(real));
+  ts.g = (real *)malloc(c * sizeof(real));
+  ts.stats = &stats[(long long)id];
+  ts.hot_acc = NULL;
+  ts.hot_n = 0;
+  if (neg_partitions > 0 && negative > 0) {
+    ts.hot_acc = (real *)calloc(hot_rows * layer1_size, sizeof(real));
+    ts.hot_pending = (int *)malloc(hot_rows * sizeof(int));
+    ts.hot_used = (char *)calloc(hot_rows, 1);
+  }
+
+  // 高频行副本: 从共享矩阵复制初值.
+  ts.rep_rows = 0;
+  ts.rep_merged = 0;
+  ts.round_random = (long long)id;
+  if (replicate_rows > 0) {
+    c = replicate_rows * layer1_size * (negative > 0 ? 2 : 1);
+    ts.rep = (real *)malloc(c * sizeof(real));
+    ts.rep_base = (real *)malloc(c * sizeof(real));
+    memcpy(ts.rep, syn0, replicate_rows * layer1_size * sizeof(real));
+    if (negative > 0) memcpy(ts.rep + replicate_rows * layer1_size, syn1neg, replicate_rows * layer1_size * sizeof(real));
+    memcpy(ts.rep_base, ts.rep, c * sizeof(real));
+    ts.rep_rows = replicate_rows;
+  }
+  
+  // step 2: 打开训练语料. 定位到某线程id对应所属的语料分片(按字节数均分, 可跨越多个文件)
+  //    流水线模式下, 句子由读取线程写入本线程的队列.
+  if (num_readers > 0) {
+    queue = &queues[(long long)id];
+  } else {
+    ShardRange(worker_id * num_threads + (long long)id, num_workers > 1 ? num_workers * num_threads : num_threads, &start_pos, &end_pos);
+    ReaderOpen(&reader, start_pos, end_pos);
+  }
+
+  // step 3: 训练主循环：
+  // 每次读取1000个词到sen[]中，进行训练.
+  //
+  while (1) {
+
+    // step 3-0: 确定性模式下, 每个句子(含取句子和更新进度)都要等轮到本线程.
+    if (deterministic && !have_turn) {
+      AcquireTurn((long long)id);
+      have_turn = 1;
+    }
+
+    // step 3-1: 更新要处理的word_count, last_word_count.
+    if (word_count - last_word_count > 10000) {
+      word_count_actual += word_count - last_word_count;
+      last_word_count = word_count;
+
+      // a.打印调试信息: 学习率alpha, 进度, 每秒钟每个线程处理words数, 以及所有线程在上次打印之后的平均损失.
+      //    用墙上时间计算: 总词数 / 经过的秒数 / 线程数.
+      if ((debug_mode > 1)) {
+        now = WallTime();
+        printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  Loss: %.4f  ", 13, alpha,
+         word_count_actual / (real)(iter * train_words + 1) * 100,
+         word_count_actual / ((now - start + 1e-6) * num_threads * 1000),
+         IntervalLoss(&progress_loss, &progress_examples));
+        fflush(stdout);
+      }
+      
+      // b.自适应学习率. 提前停止时, 在最后一轮内从stop_alpha线性降到0.
+      if (early_stop > 0) CheckLossPlateau();
+      if (stop_words > 0) {
+        alpha = stop_alpha * (1 - (word_count_actual - stop_start) / (real)(stop_words - stop_start));
+        if (word_count_actual >= stop_words) __atomic_store_n(&stop_training, 1, __ATOMIC_RELEASE);
+      } else {
+        alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
+      }
+      if (alpha < starting_alpha * 0.0001) {
+          alpha = starting_alpha * 0.0001;
+      }
+    }
+    
+    // step 3-2: 从文件中读取1000个词，组成一个sentence.
+    //    流水线模式下, 从队列中取出读取线程准备好的句子.
+    //    提前停止时不再取新的句子.
+    if (sentence_length == 0) {
+      if (__atomic_load_n(&stop_training, __ATOMIC_ACQUIRE)) break;
+      now = WallTime();
+      ts.stats->compute_time += now - last;
+      c = word_count;
+
+      if (queue != NULL) {
+        if (batch != NULL) QueuePop(queue);
+        batch = QueueFront(queue);
+        if (batch == NULL) break;
+        sen = batch->sen;
+        sentence_length = batch->length;
+        word_count += batch->word_count;
+        end_of_shard = batch->end_of_shard;
+      } else {
+        sentence_length = ReadSentence(&reader, sen, &word_count, &next_random);
+        end_of_shard = reader.eof;
+      }
+      
+      sentence_position = 0;
+
+      // 统计: 读取的词数、保留的词数、读取时间.
+      ts.stats->words_read += word_count - c;
+      ts.stats->words_kept += sentence_length;
+      ts.stats->sentences++;
+      last = WallTime();
+      ts.stats->read_time += last - now;
+    }
+
+    // step 3-3: 如果到达分片末尾，重新定位文件指针.
+    if (end_of_shard) {
+
+      // a.更新 word_count_actual 
+      word_count_actual += word_count - last_word_count;
+      
+      // b.更新 local_iter.
+      local_iter--;
+      if (deterministic) {
+        ReleaseTurn((long long)id, local_iter == 0);
+        have_turn = 0;
+      }
+      if (local_iter == 0) 
+          break;
+
+      // c.重置0.
+      word_count = 0;
+      last_word_count = 0;
+      sentence_length = 0;
+      end_of_shard = 0;
+
+      // d.重置到分片起点，进行下一轮迭代.
+      if (queue == NULL) ReaderRewind(&reader);
+      continue;
+    }
+
+    // 空句子(空行)，读取下一句
+    if (sentence_length == 0) {
+      if (deterministic) {
+        ReleaseTurn((long long)id, 0);
+        have_turn = 0;
+      }
+      continue;
+    }
+
+    // step 3-4: 获得句首词
+    word = sen[sentence_position];
+    if (word == -1) 
+        continue;
+
+    //   预取下一个窗口(最大窗口时)新进入的上下文词的syn0行, 处理当前词的期间从内存读入.
+    c = sentence_position + window + 1;
+    if (c < sentence_length && sen[c] != -1) {
+      if (syn0_bf != NULL) PrefetchRow(syn0_bf + sen[c] * layer1_size, layer1_size * sizeof(bf16));
+      else PrefetchRow(Syn0Row(&ts, sen[c]), layer1_size * sizeof(real));
+    }
+
+    // step 3-5: 初始化neu1(隐层参数)、neu1e(隐层误差值).
+    for (c = 0; c < layer1_size; c++) neu1[c] = 0;
+    for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
+
+    // step 3-6: 取window窗口的随机一个值.
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    b = next_random % window;
+
+    // step 3-7: cbow模型.
+    if (cbow) {  //train the cbow architecture
+      // cbow模型:  正向传播，从输入层到隐层
+      // in -> hidden
+      
+      
+      // a: 通过cbow模型，使用当前窗口的上下文word，更新neu1
+      //
+      // 窗口大小随机：总大小为(window*2+1-2b); 左右两侧，各为window-b
+      // b值范围：[0,window) 间随机.
+      // cw: 滑动窗口中滑动过的有效词数.
+      // 
+      // 计算过程：
+      //    一个窗口内，每个有效词，都会进行前向传播更新syn1、反向传播syn0.
+      cw = 0;  
+      for (a = b; a < window * 2 + 1 - b; a++) {
+          if (a != window) {
+
+            // a.1: 当前的word，刚好是窗口中心。从window-b开始，从左到右，且不能刚好是word自己  
+            c = sentence_position - window + a;
+            
+            // a.2: c必须大于零，且必须小于sentence_length.
+            if (c < 0) continue;
+            if (c >= sentence_length) continue;
+            
+            // a.3: 要处理的上下文word.
+            last_word = sen[c];
+            if (last_word == -1) continue;
+
+            // a.4: 根据该窗口中某个上下文word(索引)，更新neu1.
+            //      每个词输入，都与neu1上隐节点有连接
+            //
+            //      neu1 = ∑ 1*syn0     (neu1初始为0，不断更新; syn0初始随机)
+            //
+            if (syn0_bf != NULL) {
+              AccumulateBf16(neu1, syn0_bf + last_word * layer1_size);
+            } else if (subword_rows != NULL) {
+              AddSubwordInput(neu1, last_word);
+            } else {
+              row = Syn0Row(&ts, last_word);
+              for (c = 0; c < layer1_size; c++) 
+                  neu1[c] += row[c];
+            }
+
+            // 自增cw.
+            cw++;
+          }
+      }
+
+      // b: 层次化softmax/negative sampling
+      if (cw) {
+
+        // 使用除以窗口长度. neu1 = ∑ syn0/cw  
+        for (c = 0; c < layer1_size; c++) 
+            neu1[c] /= cw;
+
+        // b.1: 是否使用hs.（Hierarchical Softmax）
+        //      沿当前word的huffman编码路径向下行走, 用neu1预测每一位编码.
+        if (hs) 
+            TrainHierarchicalSoftmax(neu1, neu1e, word, &ts);
+
+        // b.2: NEGATIVE SAMPLING, negative为采样的数目.
+        if (negative > 0) 
+            TrainNegativeSampling(neu1, neu1e, word, &next_random, &ts);
+        ts.stats->loss_examples++;
+
+        // b.3: 反向传播, 根据当前窗口的上下文，利用neu1e，更新syn0
+        // hidden -> in
+        for (a = b; a < window * 2 + 1 - b; a++) {
+          if (a != window) {
+              c = sentence_position - window + a;
+              
+              // a.范围判断
+              if (c < 0) continue;
+              if (c >= sentence_length) continue;
+
+              // b.获取窗口当前词对应索引，用于检索对应的syn0.
+              last_word = sen[c];
+              if (last_word == -1) continue;
+
+              // c.更新窗口当前词所影响的syn0权重.
+              if (syn0_bf != NULL) {
+                AddToBf16(syn0_bf + last_word * layer1_size, neu1e, RoundingSeed(&ts));
+                MarkDirty(syn0_stamp, last_word);
+                continue;
+              }
+              if (subword_rows != NULL) {
+                UpdateSubwordRows(last_word, neu1e);
+                continue;
+              }
+              row = Syn0Row(&ts, last_word);
+              for (c = 0; c < layer1_size; c++) 
+                  row[c] += neu1e[c];
+              if (last_word >= ts.rep_rows) MarkDirty(syn0_stamp, last_word);
+              
+          }
+        }
+      }
+    } else {  //train skip-gram
+      for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+        c = sentence_position - window + a;
+        if (c < 0) continue;
+        if (c >= sentence_length) continue;
+        last_word = sen[c];
+        if (last_word == -1) continue;
+        // bf16存储: 把输入行转换到neu1(skip-gram中不用)中计算, 最后把neu1e加回bf16行.
+        // 子词: 输入向量(各输入行的平均)同样在neu1中计算.
+        if (syn0_bf != NULL) {
+          for (c = 0; c < layer1_size; c++) neu1[c] = 0;
+          AccumulateBf16(neu1, syn0_bf + last_word * layer1_size);
+          row = neu1;
+        } else if (subword_rows != NULL) {
+          for (c = 0; c < layer1_size; c++) neu1[c] = 0;
+          AddSubwordInput(neu1, last_word);
+          row = neu1;
+        } else row = Syn0Row(&ts, last_word);
+        for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
+        // HIERARCHICAL SOFTMAX
+        if (hs) TrainHierarchicalSoftmax(row, neu1e, word, &ts);
+        // NEGATIVE SAMPLING
+        if (negative > 0) TrainNegativeSampling(row, neu1e, word, &next_random, &ts);
+        ts.stats->loss_examples++;
+        // Learn weights input -> hidden
+        if (syn0_bf != NULL) AddToBf16(syn0_bf + last_word * layer1_size, neu1e, RoundingSeed(&ts));
+        else if (subword_rows != NULL) UpdateSubwordRows(last_word, neu1e);
+        else for (c = 0; c < layer1_size; c++) row[c] += neu1e[c];
+        if (last_word >= ts.rep_rows) MarkDirty(syn0_stamp, last_word);
+      }
+    }
+    
+    // step 3-6: 移动当前句子(1000个词)中的当前词汇指针: 移动一格.
+    sentence_position++;
+    if (sentence_position >= sentence_length) {
+      sentence_length = 0;
+      if (ts.hot_acc != NULL) FlushHotRows(&ts, (long long)id);
+      if (ts.rep_rows > 0 && ts.stats->words_read - ts.rep_merged >= replicate_words) MergeReplicas(&ts);
+      if (deterministic) {
+        ReleaseTurn((long long)id, 0);
+        have_turn = 0;
+      }
+      continue;
+    }
+  }
+
+  // 
+  if (ts.hot_acc != NULL) {
+    FlushHotRows(&ts, (long long)id);
+    free(ts.hot_acc);
+    free(ts.hot_pending);
+    free(ts.hot_used);
+  }
+  if (ts.rep_rows > 0) {
+    MergeReplicas(&ts);
+    free(ts.rep);
+    free(ts.rep_base);
+  }
+  ts.stats->compute_time += WallTime() - last;
+  ts.stats->done = 1;
+  if (deterministic && have_turn) ReleaseTurn((long long)id, 1);
+  if (queue != NULL) {
+    if (batch != NULL) QueuePop(queue);
+  } else ReaderClose(&reader);
+  free(neu1);
+  free(neu1e);
+  free(ts.target);
+  free(ts.f);
+  free(ts.p);
+  free(ts.g);
+  pthread_exit(NULL);
+}
+
+/*
+ * 输出一行JSON格式的统计信息: 总体进度与每个训练线程的计数器.
+ * utilization = 训练时间 / (读取时间 + 训练时间), 即训练线程的计算利用率.
+ * prev保存上一次输出时各线程的words_read, 用于计算区间内的速度.
+ * loss为上一次输出之后所有线程的平均损失, 各线程的loss为该线程从开始训练以来的平均损失.
+ */
+void WriteStats(FILE *fo, long long *prev, double *prev_time) {
+  static double prev_loss = 0;
+  static long long prev_examples = 0;
+  long long a, words_read = 0;
+  double now = WallTime(), dt = now - *prev_time;
+  struct thread_stats st;
+
+  for (a = 0; a < num_threads; a++) words_read += stats[a].words_read;
+  fprintf(fo, "{\"time\": %.3f, \"alpha\": %f, \"progress\": %.4f, \"words\": %lld, \"words_per_sec\": %.1f, \"loss\": %.5f, \"threads\": [",
+          now - start, alpha, word_count_actual / (real)(iter * train_words + 1), words_read, words_read / (now - start + 1e-6),
+          IntervalLoss(&prev_loss, &prev_examples));
+
+  for (a = 0; a < num_threads; a++) {
+    memcpy(&st, &stats[a], sizeof(struct thread_stats));
+    fprintf(fo, "%s{\"id\": %lld, \"done\": %d, \"words_read\": %lld, \"words_kept\": %lld, \"sentences\": %lld, "
+            "\"hs_steps\": %lld, \"hs_skipped\": %lld, \"neg_samples\": %lld, \"neg_skipped\": %lld, "
+            "\"merges\": %lld, \"loss\": %.5f, \"read_sec\": %.3f, \"compute_sec\": %.3f, \"utilization\": %.3f, \"words_per_sec\": %.1f}",
+            a ? ", " : "", a, st.done, st.words_read, st.words_kept, st.sentences,
+            st.hs_steps, st.hs_skipped, st.neg_samples, st.neg_skipped, st.merges, st.loss / (st.loss_examples + (st.loss_examples == 0)),
+            st.read_time, st.compute_time, st.compute_time / (st.read_time + st.compute_time + 1e-6),
+            (st.words_read - prev[a]) / (dt + 1e-6));
+    prev[a] = st.words_read;
+  }
+  fprintf(fo, "]}\n");
+  fflush(fo);
+  *prev_time = now;
+}
+
+/*
+ * 统计线程: 每stats_interval秒向stats_file追加一行统计信息, 训练结束时再输出一行.
+ */
+void *StatsThread(void *arg) {
+  long long *prev = (long long *)calloc(num_threads, sizeof(long long));
+  double prev_time = start, next = start + stats_interval;
+  struct timespec ts = {0, 100000000};
+
+  while (!__atomic_load_n(&stats_stop, __ATOMIC_ACQUIRE)) {
+    nanosleep(&ts, NULL);
+    if (WallTime() < next) continue;
+    pthread_mutex_lock(&stats_mutex);
+    WriteStats(stats_fo, prev, &prev_time);
+    pthread_mutex_unlock(&stats_mutex);
+    next += stats_interval;
+  }
+  pthread_mutex_lock(&stats_mutex);
+  WriteStats(stats_fo, prev, &prev_time);
+  pthread_mutex_unlock(&stats_mutex);
+
+  free(prev);
+  pthread_exit(NULL);
+}
+
+/*
+ * 输出各阶段耗时及训练速度: 有stats_file时以一行JSON追加到其末尾, 否则在debug模式下打印.
+ */
+void WritePhases() {
+  long long a, words = 0;
+  FILE *fo;
+
+  if (stats != NULL) 
+      for (a = 0; a < num_threads; a++) words += stats[a].words_read;
+  if (num_workers > 1) words = dist_words;
+
+  if (stats_file[0] == 0) {
+    if (debug_mode > 0) 
+        printf("\nPhases: vocab %.3fs (phrases %.3fs), init-net %.3fs (tree %.3fs), unigram %.3fs, train %.3fs, save %.3fs\n",
+               phases.vocab, phases.phrase, phases.init_net, phases.tree, phases.unigram, phases.train, phases.save);
+    return;
+  }
+
+  fo = fopen(stats_file, "ab");
+  if (fo == NULL) {
+    printf("ERROR: cannot open stats file %s\n", stats_file);
+    exit(1);
+  }
+  fprintf(fo, "{\"phases\": {\"vocab_sec\": %.4f, \"phrase_sec\": %.4f, \"init_net_sec\": %.4f, \"tree_sec\": %.4f, \"unigram_sec\": %.4f, \"train_sec\": %.4f, \"save_sec\": %.4f}, "
+          "\"vocab_size\": %lld, \"train_words\": %lld, \"threads\": %d, \"epochs\": %.3f, \"words\": %lld, "
+          "\"words_per_sec\": %.1f, \"words_per_thread_sec\": %.1f}\n",
+          phases.vocab, phases.phrase, phases.init_net, phases.tree, phases.unigram, phases.train, phases.save,
+          vocab_size, train_words, num_threads * (num_workers > 1 ? num_workers : 1), words / (double)(train_words + 1), words,
+          words / (phases.train + 1e-6), words / (phases.train + 1e-6) / num_threads / (num_workers > 1 ? num_workers : 1));
+  fclose(fo);
+}
+
+/*
+ * 评测: 类比(a:b::c:?)与词相似度.
+ *
+ * 类比文件的格式与原始的questions-words.txt相同: ": 分类名"开始一个分类,
+ * 其后每行一个问题"a b c d". 与compute-accuracy相同, 只在词频最高的eval_top个词中搜索答案,
+ * 四个词中有任何一个不在其中的问题不计入(seen).
+ * 相似度文件每行"w1 w2 分数"(空格/tab/逗号分隔, #开头的行忽略), 输出余弦相似度与人工分数的Spearman相关系数.
+ */
+struct eval_questions {
+  long long n,              // 问题数
+       sections;            // 分类数
+  int *words,               // 每个问题4个词在vocab中的索引, 词不在词汇表中时为-1
+      *section;             // 每个问题所属的分类
+  char (*section_name)[MAX_STRING];
+};
+
+/**
+ * 相似度评测的词对.
+ */
+struct eval_pairs {
+  long long n;              // 词对数
+  int *words;               // 每个词对2个词在vocab中的索引, 词不在词汇表中时为-1
+  double *score;            // 人工标注的分数
+};
+
+/**
+ * 类比评测线程的参数: 在m的前rows行(已归一化)中为问题找答案, answer为找到的词.
+ */
+struct eval_job {
+  real *m;
+  long long rows,
+       next;                // 下一个要处理的问题批次, 各线程原子地领取
+  struct eval_questions *q;
+  int *answer;
+};
+
+/*
+ * 读取类比问题文件.
+ */
+void ReadAnalogyQuestions(char *file, struct eval_questions *q) {
+  long long a, max_n = 1000, max_sections = 16;
+  char line[4 * MAX_STRING], w[4][MAX_STRING];
+  FILE *fin = fopen(file, "rb");
+
+  if (fin == NULL) {
+    printf("ERROR: analogy file %s not found\n", file);
+    exit(1);
+  }
+  q->n = 0;
+  q->sections = 0;
+  q->words = (int *)malloc(max_n * 4 * sizeof(int));
+  q->section = (int *)malloc(max_n * sizeof(int));
+  q->section_name = (char (*)[MAX_STRING])malloc(max_sections * MAX_STRING);
+  while (fgets(line, sizeof(line), fin) != NULL) {
+    if (line[0] == ':') {
+      if (q->sections == max_sections) {
+        max_sections *= 2;
+        q->section_name = (char (*)[MAX_STRING])realloc(q->section_name, max_sections * MAX_STRING);
+      }
+      if (sscanf(line + 1, "%99s", q->section_name[q->sections]) != 1) strcpy(q->section_name[q->sections], "-");
+      q->sections++;
+      continue;
+    }
+    if (sscanf(line, "%99s %99s %99s %99s", w[0], w[1], w[2], w[3]) != 4) continue;
+    if (q->sections == 0) strcpy(q->section_name[q->sections++], "-");
+    if (q->n == max_n) {
+      max_n *= 2;
+      q->words = (int *)realloc(q->words, max_n * 4 * sizeof(int));
+      q->section = (int *)realloc(q->section, max_n * sizeof(int));
+    }
+    for (a = 0; a < 4; a++) q->words[q->n * 4 + a] = SearchVocab(w[a]);
+    q->section[q->n] = q->sections - 1;
+    q->n++;
+  }
+  fclose(fin);
+}
+
+/*
+ * 读取词相似度文件.
+ */
+void ReadSimilarityPairs(char *file, struct eval_pairs *p) {
+  long long max_n = 1000;
+  char line[4 * MAX_STRING], w1[MAX_STRING], w2[MAX_STRING], *s;
+  double score;
+  FILE *fin = fopen(file, "rb");
+
+  if (fin == NULL) {
+    printf("ERROR: similarity file %s not found\n", file);
+    exit(1);
+  }
+  p->n = 0;
+  p->words = (int *)malloc(max_n * 2 * sizeof(int));
+  p->score = (double *)malloc(max_n * sizeof(double));
+  while (fgets(line, sizeof(line), fin) != NULL) {
+    if (line[0] == '#') continue;
+    for (s = line; *s; s++) if (*s == ',' || *s == '\t') *s = ' ';
+    if (sscanf(line, "%99s %99s %lf", w1, w2, &score) != 3) continue;
+    if (p->n == max_n) {
+      max_n *= 2;
+      p->words = (int *)realloc(p->words, max_n * 2 * sizeof(int));
+      p->score = (double *)realloc(p->score, max_n * sizeof(double));
+    }
+    p->words[p->n * 2] = SearchVocab(w1);
+    p->words[p->n * 2 + 1] = SearchVocab(w2);
+    p->score[p->n] = score;
+    p->n++;
+  }
+  fclose(fin);
+}
+
+/*
+ * 复制矩阵m的前rows行并把每行归一化为单位长度.
+ */
+real *NormalizeRows(real *m, long long rows) {
+  long long a, b;
+  real *n = NULL, len;
+
+  a = posix_memalign((void **)&n, 128, rows * layer1_size * sizeof(real));
+  if (n == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < rows; a++) {
+    len = 0;
+    for (b = 0; b < layer1_size; b++) len += m[a * layer1_size + b] * m[a * layer1_size + b];
+    len = sqrt(len);
+    if (len == 0) len = 1;
+    for (b = 0; b < layer1_size; b++) n[a * layer1_size + b] = m[a * layer1_size + b] / len;
+  }
+  return n;
+}
+
+/*
+ * 类比评测线程: 每次领取EVAL_BATCH个问题, 问题向量b - a + c组成矩阵Q,
+ * 扫描一遍m计算m * Q^T: m的每一行读入cache后与所有问题向量做点积,
+ * 把对m的读取次数降为1/EVAL_BATCH. 答案为点积最大且不是a/b/c的词.
+ */
+void *EvalAnalogyThread(void *arg) {
+  struct eval_job *job = (struct eval_job *)arg;
+  long long a, b, c, r, first, n, *w;
+  real *query = NULL, *row, best[EVAL_BATCH], f;
+  int *q, ok[EVAL_BATCH];
+
+  a = posix_memalign((void **)&query, 128, EVAL_BATCH * layer1_size * sizeof(real));
+  if (query == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  w = (long long *)malloc(EVAL_BATCH * 3 * sizeof(long long));
+  while (1) {
+    first = __atomic_fetch_add(&job->next, EVAL_BATCH, __ATOMIC_RELAXED);
+    if (first >= job->q->n) break;
+    n = job->q->n - first < EVAL_BATCH ? job->q->n - first : EVAL_BATCH;
+
+    // 1. 组成问题矩阵. 有词不在前rows个词中的问题不参与计算.
+    for (a = 0; a < n; a++) {
+      q = job->q->words + (first + a) * 4;
+      ok[a] = 1;
+      for (b = 0; b < 4; b++) if (q[b] < 0 || q[b] >= job->rows) ok[a] = 0;
+      best[a] = -1e30;
+      job->answer[first + a] = -1;
+      for (b = 0; b < 3; b++) w[a * 3 + b] = q[b];
+      for (c = 0; c < layer1_size; c++) 
+          query[a * layer1_size + c] = ok[a] ? job->m[q[1] * layer1_size + c] - job->m[q[0] * layer1_size + c] + job->m[q[2] * layer1_size + c] : 0;
+    }
+
+    // 2. 扫描m的每一行, 与n个问题向量做点积.
+    for (r = 0; r < job->rows; r++) {
+      row = job->m + r * layer1_size;
+      for (a = 0; a < n; a++) {
+        if (!ok[a]) continue;
+        f = 0;
+        for (c = 0; c < layer1_size; c++) f += row[c] * query[a * layer1_size + c];
+        if (f > best[a] && r != w[a * 3] && r != w[a * 3 + 1] && r != w[a * 3 + 2]) {
+          best[a] = f;
+          job->answer[first + a] = r;
+        }
+      }
+    }
+  }
+  free(query);
+  free(w);
+  pthread_exit(NULL);
+}
+
+/*
+ * 类比评测: m为已归一化的矩阵, 只在前rows行中搜索答案, 使用threads个线程.
+ * 返回准确率(正确数 / seen), seen返回参与评测的问题数.
+ * verbose时打印每个分类的准确率.
+ */
+double EvalAnalogy(struct eval_questions *q, real *m, long long rows, long long *seen, int verbose, int threads) {
+  long long a, b, correct = 0, *sec_correct, *sec_seen, sem_correct = 0, sem_seen = 0;
+  pthread_t *pt = (pthread_t *)malloc(threads * sizeof(pthread_t));
+  struct eval_job job;
+
+  job.m = m;
+  job.rows = rows;
+  job.next = 0;
+  job.q = q;
+  job.answer = (int *)malloc((q->n + 1) * sizeof(int));
+  for (a = 0; a < threads; a++) pthread_create(&pt[a], NULL, EvalAnalogyThread, (void *)&job);
+  for (a = 0; a < threads; a++) pthread_join(pt[a], NULL);
+
+  sec_correct = (long long *)calloc(q->sections + 1, sizeof(long long));
+  sec_seen = (long long *)calloc(q->sections + 1, sizeof(long long));
+  *seen = 0;
+  for (a = 0; a < q->n; a++) {
+    if (job.answer[a] < 0) continue;
+    b = (job.answer[a] == q->words[a * 4 + 3]);
+    (*seen)++;
+    correct += b;
+    sec_seen[q->section[a]]++;
+    sec_correct[q->section[a]] += b;
+  }
+  if (verbose) {
+    for (a = 0; a < q->sections; a++) {
+      if (sec_seen[a] == 0) continue;
+      printf("  %-32s %6.2f %%  (%lld / %lld)\n", q->section_name[a], sec_correct[a] * 100.0 / sec_seen[a], sec_correct[a], sec_seen[a]);
+      // 与compute-accuracy相同: 名字以gram开头的分类为语法类比, 其余为语义类比.
+      if (strncmp(q->section_name[a], "gram", 4)) {
+        sem_correct += sec_correct[a];
+        sem_seen += sec_seen[a];
+      }
+    }
+    printf("  Semantic accuracy: %.2f %%  Syntactic accuracy: %.2f %%\n",
+           sem_correct * 100.0 / (sem_seen + (sem_seen == 0)),
+           (correct - sem_correct) * 100.0 / (*seen - sem_seen + (*seen == sem_seen)));
+  }
+  free(sec_correct);
+  free(sec_seen);
+  free(job.answer);
+  free(pt);
+  return correct / (double)(*seen + (*seen == 0));
+}
+
+/*
+ * Spearman秩相关中用到的排序键.
+ */
+struct rank_item {
+  double value;
+  long long index;
+};
+
+int RankCompare(const void *a, const void *b) {
+  double d = ((struct rank_item *)a)->value - ((struct rank_item *)b)->value;
+  return (d > 0) - (d < 0);
+}
+
+/*
+ * 计算x[0, n)的秩, 相同的值取平均秩.
+ */
+void Rank(double *x, double *rank, long long n) {
+  long long a, b, c;
+  struct rank_item *it = (struct rank_item *)malloc(n * sizeof(struct rank_item));
+
+  for (a = 0; a < n; a++) {
+    it[a].value = x[a];
+    it[a].index = a;
+  }
+  qsort(it, n, sizeof(struct rank_item), RankCompare);
+  for (a = 0; a < n; a = b) {
+    for (b = a + 1; b < n && it[b].value == it[a].value; b++);
+    for (c = a; c < b; c++) rank[it[c].index] = (a + b - 1) / 2.0;
+  }
+  free(it);
+}
+
+/*
+ * 词相似度评测: m为已归一化的矩阵(前rows行). 对两个词都在m中的词对,
+ * 返回余弦相似度与人工分数的Spearman相关系数, found返回参与评测的词对数.
+ */
+double EvalSimilarity(struct eval_pairs *p, real *m, long long rows, long long *found) {
+  long long a, c, n = 0, w1, w2;
+  double *sim = (double *)malloc((p->n + 1) * sizeof(double)),
+         *score = (double *)malloc((p->n + 1) * sizeof(double)),
+         *r1 = (double *)malloc((p->n + 1) * sizeof(double)),
+         *r2 = (double *)malloc((p->n + 1) * sizeof(double)),
+         f, mean = 0, cov = 0, v1 = 0, v2 = 0;
+
+  for (a = 0; a < p->n; a++) {
+    w1 = p->words[a * 2];
+    w2 = p->words[a * 2 + 1];
+    if (w1 < 0 || w2 < 0 || w1 >= rows || w2 >= rows) continue;
+    f = 0;
+    for (c = 0; c < layer1_size; c++) f += m[w1 * layer1_size + c] * m[w2 * layer1_size + c];
+    sim[n] = f;
+    score[n] = p->score[a];
+    n++;
+  }
+  *found = n;
+
+  // Spearman相关系数 = 秩的Pearson相关系数.
+  Rank(sim, r1, n);
+  Rank(score, r2, n);
+  mean = (n - 1) / 2.0;
+  for (a = 0; a < n; a++) {
+    cov += (r1[a] - mean) * (r2[a] - mean);
+    v1 += (r1[a] - mean) * (r1[a] - mean);
+    v2 += (r2[a] - mean) * (r2[a] - mean);
+  }
+  free(sim);
+  free(score);
+  free(r1);
+  free(r2);
+  return (v1 > 0 && v2 > 0) ? cov / sqrt(v1 * v2) : 0;
+}
+
+/*
+ * 训练结束后评测syn0: 只归一化一次, 打印类比准确率、相似度相关系数和耗时;
+ * 有stats_file时再以一行JSON追加到其末尾.
+ */
+void EvalModel() {
+  long long rows = eval_top < vocab_size ? eval_top : vocab_size, seen = 0, found = 0;
+  double t = WallTime(), t_norm, t_analogy = 0, t_sim = 0, acc = 0, rho = 0;
+  struct eval_questions q;
+  struct eval_pairs p;
+  real *m;
+  FILE *fo;
+
+  // 相似度评测在整个词汇表上进行, 类比只在前rows个词中搜索.
+  m = NormalizeRows(syn0, vocab_size);
+  t_norm = WallTime() - t;
+  if (eval_analogy_file[0] != 0) {
+    t = WallTime();
+    ReadAnalogyQuestions(eval_analogy_file, &q);
+    printf("\nAnalogy (top %lld words, %d threads):\n", rows, num_threads);
+    acc = EvalAnalogy(&q, m, rows, &seen, 1, num_threads);
+    t_analogy = WallTime() - t;
+    printf("  Accuracy: %.2f %%  Questions seen / total: %lld / %lld  (%.2f %%)  Time: %.3fs\n",
+           acc * 100, seen, q.n, seen * 100.0 / (q.n + (q.n == 0)), t_analogy);
+    free(q.words);
+    free(q.section);
+    free(q.section_name);
+  }
+  if (eval_similarity_file[0] != 0) {
+    t = WallTime();
+    ReadSimilarityPairs(eval_similarity_file, &p);
+    rho = EvalSimilarity(&p, m, vocab_size, &found);
+    t_sim = WallTime() - t;
+    printf("\nSimilarity: Spearman rho %.4f  Pairs found / total: %lld / %lld  Time: %.3fs\n", rho, found, p.n, t_sim);
+    free(p.words);
+    free(p.score);
+  }
+  free(m);
+
+  if (stats_file[0] == 0) return;
+  fo = fopen(stats_file, "ab");
+  if (fo == NULL) {
+    printf("ERROR: cannot open stats file %s\n", stats_file);
+    exit(1);
+  }
+  fprintf(fo, "{\"eval\": {\"top\": %lld, \"normalize_sec\": %.4f, \"analogy_accuracy\": %.4f, \"analogy_seen\": %lld, \"analogy_sec\": %.4f, "
+          "\"similarity_rho\": %.4f, \"similarity_pairs\": %lld, \"similarity_sec\": %.4f}}\n",
+          rows, t_norm, acc, seen, t_analogy, rho, found, t_sim);
+  fclose(fo);
+}
+
+/*
+ * 读取已训练好的词向量文件(word2vec的输出格式, -binary指定是否为二进制), 只做评测不训练.
+ * 文件中的词按词频从高到低排列, 所以前eval_top个词即为高频词.
+ */
+void ReadVectors() {
+  long long a, b, words, size;
+  char word[MAX_STRING];
+  FILE *fin = fopen(read_vectors_file, "rb");
+
+  if (fin == NULL) {
+    printf("ERROR: vectors file %s not found\n", read_vectors_file);
+    exit(1);
+  }
+  if (fscanf(fin, "%lld %lld", &words, &size) != 2) {
+    printf("ERROR: invalid vectors file %s\n", read_vectors_file);
+    exit(1);
+  }
+  layer1_size = size;
+  ResetVocabHash(words);
+  vocab_size = 0;
+  a = posix_memalign((void **)&syn0, 128, words * layer1_size * sizeof(real));
+  if (syn0 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < words; a++) {
+    if (fscanf(fin, "%99s", word) != 1) break;
+    fgetc(fin);
+    AddWordToVocab(word);
+    if (binary) {
+      if (fread(&syn0[a * layer1_size], sizeof(real), layer1_size, fin) != (size_t)layer1_size) break;
+    } else {
+      for (b = 0; b < layer1_size; b++) 
+          if (fscanf(fin, "%f", &syn0[a * layer1_size + b]) != 1) break;
+      if (b < layer1_size) break;
+    }
+  }
+  fclose(fin);
+  if (a < words) {
+    printf("ERROR: vectors file %s is truncated (%lld of %lld words)\n", read_vectors_file, a, words);
+    exit(1);
+  }
+  if (debug_mode > 0) printf("Read %lld vectors of size %lld from %s\n", vocab_size, layer1_size, read_vectors_file);
+}
+
+/*
+ * 训练结束后, 把每个词的syn0行替换为它的输入向量(自身行与n-gram行的平均), 输出的词向量即为训练时使用的向量.
+ * 词表外的词的向量见QueryVectors().
+ */
+void ComposeSubwordVectors() {
+  long long a, c;
+  real *v = (real *)malloc(layer1_size * sizeof(real));
+
+  for (a = 0; a < vocab_size; a++) {
+    for (c = 0; c < layer1_size; c++) v[c] = 0;
+    AddSubwordInput(v, a);
+    memcpy(syn0 + a * layer1_size, v, layer1_size * sizeof(real));
+  }
+  free(v);
+}
+
+/*
+ * 保存n-gram的bucket行: 一行文本头"buckets size minn maxn", 之后为buckets x size个float.
+ */
+void SaveSubwords() {
+  FILE *fo = fopen(save_subwords_file, "wb");
+
+  if (fo == NULL) {
+    printf("ERROR: cannot open subwords file %s\n", save_subwords_file);
+    exit(1);
+  }
+  fprintf(fo, "%lld %lld %d %d\n", subword_buckets, layer1_size, subword_minn, subword_maxn);
+  fwrite(syn0 + vocab_size * layer1_size, sizeof(real), subword_buckets * layer1_size, fo);
+  fclose(fo);
+}
+
+/*
+ * 读取SaveSubwords()保存的bucket行, 放在syn0(ReadVectors()读入的词向量)之后.
+ */
+void ReadSubwords() {
+  long long size;
+  real *m;
+  FILE *fin = fopen(read_subwords_file, "rb");
+
+  if (fin == NULL) {
+    printf("ERROR: subwords file %s not found\n", read_subwords_file);
+    exit(1);
+  }
+  if (fscanf(fin, "%lld %lld %d %d", &subword_buckets, &size, &subword_minn, &subword_maxn) != 4 || fgetc(fin) != '\n' ||
+      size != layer1_size || subword_buckets <= 0 || subword_minn < 1 || subword_maxn < subword_minn) {
+    printf("ERROR: invalid subwords file %s\n", read_subwords_file);
+    exit(1);
+  }
+  if (posix_memalign((void **)&m, 128, (vocab_size + subword_buckets) * layer1_size * sizeof(real)) != 0) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  memcpy(m, syn0, vocab_size * layer1_size * sizeof(real));
+  free(syn0);
+  syn0 = m;
+  if (fread(syn0 + vocab_size * layer1_size, sizeof(real), subword_buckets * layer1_size, fin) != (size_t)(subword_buckets * layer1_size)) {
+    printf("ERROR: subwords file %s is truncated\n", read_subwords_file);
+    exit(1);
+  }
+  fclose(fin);
+}
+
+/*
+ * 查询query_file中每个词(每行一个)的向量, 以文本格式写到output_file(未指定时为标准输出).
+ * 词表中的词直接输出其向量; 词表外的词为其n-gram行的平均(需要-read-subwords), 没有n-gram时为0向量.
+ */
+void QueryVectors() {
+  long long a, b, c, n, found = 0, oov = 0, words = 0;
+  char word[MAX_STRING];
+  real *v = (real *)malloc(layer1_size * sizeof(real));
+  int *ngrams = (int *)malloc((MAX_STRING + 2) * (subword_maxn - subword_minn + 1) * sizeof(int));
+  FILE *fin = fopen(query_file, "rb"), *fo = stdout;
+
+  if (fin == NULL) {
+    printf("ERROR: query file %s not found\n", query_file);
+    exit(1);
+  }
+  if (output_file[0] != 0) fo = fopen(output_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot open %s\n", output_file);
+    exit(1);
+  }
+
+  while (fscanf(fin, "%99s", word) == 1) {
+    words++;
+    for (c = 0; c < layer1_size; c++) v[c] = 0;
+    a = SearchVocab(word);
+    if (a != -1) {
+      memcpy(v, syn0 + a * layer1_size, layer1_size * sizeof(real));
+      found++;
+    } else if (subword_buckets > 0 && (n = WordNgrams(word, ngrams)) > 0) {
+      for (b = 0; b < n; b++) 
+          for (c = 0; c < layer1_size; c++) v[c] += syn0[(vocab_size + ngrams[b]) * layer1_size + c] / n;
+      oov++;
+    }
+    fprintf(fo, "%s", word);
+    for (c = 0; c < layer1_size; c++) fprintf(fo, " %lf", v[c]);
+    fprintf(fo, "\n");
+  }
+  fclose(fin);
+  if (fo != stdout) fclose(fo);
+  if (debug_mode > 0 && fo != stdout) 
+      printf("Queried %lld words: %lld in vocabulary, %lld from subwords, %lld unknown\n", words, found, oov, words - found - oov);
+  free(v);
+  free(ngrams);
+}
+
+/**
+ * 训练中评测的损失估计样本: 从语料开头读取的一小段固定样本, 每次评测都在同一批样本上计算,
+ * 损失曲线才可比. 一个样本为(输入词, 目标词): 输入为context[offset[i], offset[i + 1])中
+ * 词向量的平均, CBOW时为窗口内的所有上下文词, skip-gram时为一个上下文词.
+ */
+struct loss_sample {
+  long long n;              // 样本数
+  int *target,              // 目标词
+      *offset,              // 输入词在context中的区间, 长度n + 1
+      *context,             // 输入词
+      *negs;                // NS: 每个样本的negative个负样本, 在生成样本时固定下来
+};
+
+/**
+ * 监控线程的累计开销, 训练结束时用于估计它对训练速度的影响.
+ */
+struct monitor_totals {
+  long long evals,          // 评测次数
+       eval_words;          // 评测期间训练线程读取的词数
+  double eval_time;         // 评测的总耗时(秒)
+};
+
+struct monitor_totals monitor;
+
+/*
+ * 所有训练线程已读取的词数. 比word_count_actual更及时(每个句子更新一次).
+ */
+long long WordsRead() {
+  long long a, words = 0;
+  for (a = 0; a < num_threads; a++) words += __atomic_load_n(&stats[a].words_read, __ATOMIC_RELAXED);
+  return words;
+}
+
+/*
+ * 从语料开头读取MONITOR_WORDS个词, 生成损失估计样本.
+ * 窗口固定为window(不随机缩小), 不做subsampling.
+ */
+void ReadLossSample(struct loss_sample *s) {
+  struct corpus_reader r;
+  long long a, b, lo, hi, n = 0, ctx = 0, len = 0, max_context;
+  unsigned long long next_random = 1;
+  int *sen = (int *)malloc(MONITOR_WORDS * sizeof(int)), word;
+
+  // 1. 读取词, 0(</s>)为句子边界.
+  ReaderOpen(&r, 0, file_size);
+  while (len < MONITOR_WORDS) {
+    word = ReadWordIndex(&r);
+    if (r.eof) break;
+    if (word < 0) continue;
+    sen[len++] = word;
+  }
+  ReaderClose(&r);
+
+  // 2. 每个位置的窗口内的上下文词. skip-gram每个上下文词是一个样本, CBOW每个位置是一个样本.
+  max_context = len * 2 * window;
+  s->target = (int *)malloc((max_context + 1) * sizeof(int));
+  s->offset = (int *)malloc((max_context + 2) * sizeof(int));
+  s->context = (int *)malloc((max_context + 1) * sizeof(int));
+  s->offset[0] = 0;
+  for (a = 0; a < len; a++) {
+    if (sen[a] == 0) continue;
+    // 窗口不跨越句子边界.
+    for (lo = a; lo > 0 && a - lo < window && sen[lo - 1] != 0; lo--);
+    for (hi = a; hi < len - 1 && hi - a < window && sen[hi + 1] != 0; hi++);
+    for (b = lo; b <= hi; b++) {
+      if (b == a) continue;
+      s->context[ctx++] = sen[b];
+      if (!cbow) {
+        s->target[n] = sen[a];
+        s->offset[++n] = ctx;
+      }
+    }
+    if (cbow && hi > lo) {
+      s->target[n] = sen[a];
+      s->offset[++n] = ctx;
+    }
+  }
+  s->n = n;
+
+  // 3. 固定每个样本的负样本.
+  s->negs = NULL;
+  if (negative > 0) {
+    s->negs = (int *)malloc((n * negative + 1) * sizeof(int));
+    for (a = 0; a < n * negative; a++) {
+      do {
+        next_random = next_random * (unsigned long long)25214903917 + 11;
+        word = table[(next_random >> 16) % table_size];
+        if (word == 0) word = next_random % (vocab_size - 1) + 1;
+      } while (word == s->target[a / negative] && vocab_size > 2);
+      s->negs[a] = word;
+    }
+  }
+  free(sen);
+}
+
+/*
+ * log(sigmoid(x)), 对大的|x|也不溢出.
+ */
+double LogSigmoid(double x) {
+  return x < 0 ? x - log1p(exp(x)) : -log1p(exp(-x));
+}
 
-    // step 3-5: 初始化neu1(隐层参数)、neu1e(隐层误差值).
-    for (c = 0; c < layer1_size; c++) neu1[c] = 0;
-    for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
+/*
+ * 在样本上计算当前模型的平均损失(负对数似然): HS为路径上每一位编码的logistic损失之和,
+ * NS为正样本与负样本的logistic损失之和; 两者都开启时相加.
+ * 与训练线程并发地读取syn0/syn1/syn1neg, 不加锁.
+ */
+double LossEstimate(struct loss_sample *s) {
+  long long a, b, c, d, l2;
+  real *in = (real *)malloc(layer1_size * sizeof(real)), f;
+  double loss = 0;
+
+  for (a = 0; a < s->n; a++) {
+    // 输入向量: 上下文词向量的平均.
+    for (c = 0; c < layer1_size; c++) in[c] = 0;
+    for (b = s->offset[a]; b < s->offset[a + 1]; b++) 
+        for (c = 0; c < layer1_size; c++) in[c] += syn0[s->context[b] * layer1_size + c];
+    for (c = 0; c < layer1_size; c++) in[c] /= s->offset[a + 1] - s->offset[a];
+
+    // HS: 编码为0的节点标签为1.
+    if (hs) for (d = 0; d < vocab[s->target[a]].codelen; d++) {
+      l2 = vocab[s->target[a]].point[d] * layer1_size;
+      f = 0;
+      for (c = 0; c < layer1_size; c++) f += in[c] * syn1[c + l2];
+      loss -= LogSigmoid(vocab[s->target[a]].code[d] ? -f : f);
+    }
 
-    // step 3-6: 取window窗口的随机一个值.
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    b = next_random % window;
+    // NS: 正样本标签为1, 负样本为0.
+    if (negative > 0) for (d = 0; d <= negative; d++) {
+      l2 = (d ? s->negs[a * negative + d - 1] : s->target[a]) * layer1_size;
+      f = 0;
+      for (c = 0; c < layer1_size; c++) f += in[c] * syn1neg[c + l2];
+      loss -= LogSigmoid(d ? -f : f);
+    }
+  }
+  free(in);
+  return loss / (s->n + (s->n == 0));
+}
 
-    // step 3-7: cbow模型.
-    if (cbow) {  //train the cbow architecture
-      // cbow模型:  正向传播，从输入层到隐层
-      // in -> hidden
-      
-      
-      // a: 通过cbow模型，使用当前窗口的上下文word，更新neu1
-      //
-      // 窗口大小随机：总大小为(window*2+1-2b); 左右两侧，各为window-b
-      // b值范围：[0,window) 间随机.
-      // cw: 滑动窗口中滑动过的有效词数.
-      // 
-      // 计算过程：
-      //    一个窗口内，每个有效词，都会进行前向传播更新syn1、反向传播syn0.
-      cw = 0;  
-      for (a = b; a < window * 2 + 1 - b; a++) {
-          if (a != window) {
+/*
+ * 监控线程: 训练线程每读取eval_interval个词, 对模型做一次快照评测, 不打断训练线程.
+ *
+ * 快照只复制并归一化syn0中词频最高的eval_top行(类比只在这些词中搜索, 相似度只统计这些词),
+ * 复制时训练线程仍在无锁更新syn0, 每个float的读写是原子的, 快照最多混入正在进行的
+ * 少量更新, 对评测指标来说足够一致. 类比只用均匀抽取的最多MONITOR_QUESTIONS个问题,
+ * 评测只用本线程计算, 损失在固定的样本上直接读取当前矩阵计算.
+ */
+void *MonitorThread(void *arg) {
+  long long a, rows = eval_top < vocab_size ? eval_top : vocab_size, seen = 0, found = 0,
+       words, next = eval_interval, stride;
+  double t, acc = 0, rho = 0, loss;
+  struct eval_questions q, sub;
+  struct eval_pairs p;
+  struct loss_sample s;
+  struct timespec ts = {0, 10000000};
+  real *m;
+
+  // 1. 读取评测数据, 抽取类比问题的子集, 生成损失样本.
+  sub.n = 0;
+  if (eval_analogy_file[0] != 0) {
+    ReadAnalogyQuestions(eval_analogy_file, &q);
+    stride = (q.n + MONITOR_QUESTIONS - 1) / MONITOR_QUESTIONS;
+    if (stride < 1) stride = 1;
+    sub = q;
+    sub.words = (int *)malloc((q.n / stride + 1) * 4 * sizeof(int));
+    sub.section = (int *)malloc((q.n / stride + 1) * sizeof(int));
+    for (a = 0, sub.n = 0; a < q.n; a += stride, sub.n++) {
+      memcpy(sub.words + sub.n * 4, q.words + a * 4, 4 * sizeof(int));
+      sub.section[sub.n] = q.section[a];
+    }
+    free(q.words);
+    free(q.section);
+  }
+  p.n = 0;
+  if (eval_similarity_file[0] != 0) ReadSimilarityPairs(eval_similarity_file, &p);
+  ReadLossSample(&s);
+
+  while (!__atomic_load_n(&stats_stop, __ATOMIC_ACQUIRE)) {
+    nanosleep(&ts, NULL);
+    if ((words = WordsRead()) < next) continue;
+    next += eval_interval;
+
+    // 2. 快照与评测.
+    t = WallTime();
+    m = NormalizeRows(syn0, rows);
+    if (sub.n > 0) acc = EvalAnalogy(&sub, m, rows, &seen, 0, 1);
+    if (p.n > 0) rho = EvalSimilarity(&p, m, rows, &found);
+    free(m);
+    loss = LossEstimate(&s);
+    t = WallTime() - t;
+    monitor.evals++;
+    monitor.eval_time += t;
+    monitor.eval_words += WordsRead() - words;
+
+    // 3. 输出.
+    if (debug_mode > 0) {
+      printf("\nEval at %lld words (%.2f%%): ", words, words * 100.0 / (iter * train_words + 1));
+      if (sub.n > 0) printf("analogy %.2f%% (%lld seen), ", acc * 100, seen);
+      if (p.n > 0) printf("similarity %.4f (%lld pairs), ", rho, found);
+      printf("loss %.4f, %.3fs\n", loss, t);
+      fflush(stdout);
+    }
+    if (stats_fo != NULL) {
+      pthread_mutex_lock(&stats_mutex);
+      fprintf(stats_fo, "{\"monitor\": {\"time\": %.3f, \"words\": %lld, \"progress\": %.4f, \"analogy_accuracy\": %.4f, \"analogy_seen\": %lld, "
+              "\"similarity_rho\": %.4f, \"similarity_pairs\": %lld, \"loss\": %.5f, \"loss_samples\": %lld, \"eval_sec\": %.4f}}\n",
+              WallTime() - start, words, words / (double)(iter * train_words + 1), acc, seen, rho, found, loss, s.n, t);
+      fflush(stats_fo);
+      pthread_mutex_unlock(&stats_mutex);
+    }
+  }
 
-            // a.1: 当前的word，刚好是窗口中心。从window-b开始，从左到右，且不能刚好是word自己  
-            c = sentence_position - window + a;
-            
-            // a.2: c必须大于零，且必须小于sentence_length.
-            if (c < 0) continue;
-            if (c >= sentence_length) continue;
-            
-            // a.3: 要处理的上下文word.
-            last_word = sen[c];
-            if (last_word == -1) continue;
+  if (eval_analogy_file[0] != 0) {
+    free(sub.words);
+    free(sub.section);
+    free(sub.section_name);
+  }
+  if (p.n > 0) {
+    free(p.words);
+    free(p.score);
+  }
+  free(s.target);
+  free(s.offset);
+  free(s.context);
+  free(s.negs);
+  pthread_exit(NULL);
+}
 
-            // a.4: 根据该窗口中某个上下文word(索引)，更新neu1.
-            //      每个词输入，都与neu1上隐节点有连接
-            //
-            //      neu1 = ∑ 1*syn0     (neu1初始为0，不断更新; syn0初始随机)
-            //
-            for (c = 0; c < layer1_size; c++) 
-                neu1[c] += syn0[c + last_word * layer1_size];
+/*
+ * 估计监控线程对训练速度的影响: 比较评测期间与其余时间训练线程的读词速度. train_sec为本进程训练线程的运行时间.
+ */
+void WriteMonitorSummary(double train_sec) {
+  long long words = WordsRead();
+  double idle_time = train_sec - monitor.eval_time,
+         idle_rate = (words - monitor.eval_words) / (idle_time + 1e-6),
+         eval_rate = monitor.eval_words / (monitor.eval_time + 1e-6),
+         // 没有监控线程时, 整个训练期间都按idle_rate训练.
+         overhead = 1 - words / (idle_rate * train_sec + 1e-6);
+
+  if (debug_mode > 0) 
+      printf("\nMonitor: %lld evals, %.3fs; words/sec %.1f during evals vs %.1f otherwise, overall overhead %.2f%%\n",
+             monitor.evals, monitor.eval_time, eval_rate, idle_rate, overhead * 100);
+  if (stats_fo != NULL) 
+      fprintf(stats_fo, "{\"monitor_summary\": {\"evals\": %lld, \"eval_sec\": %.4f, \"words_per_sec_during_eval\": %.1f, "
+              "\"words_per_sec_otherwise\": %.1f, \"overhead\": %.4f}}\n",
+              monitor.evals, monitor.eval_time, eval_rate, idle_rate, overhead);
+}
 
-            // 自增cw.
-            cw++;
-          }
-      }
+/**
+ * 分布式训练: 同步消息头. 工作进程 -> 协调进程: 其后依次为每个同步矩阵上次同步后被更新过的
+ * n[k]个行号及其增量; 协调进程 -> 工作进程: 其后为各工作进程发来的行的并集及其平均增量.
+ */
+struct sync_header {
+  long long words,          // 工作进程累计读取的词数
+       n[3];                // 每个同步矩阵的行数
+  int done;                 // 工作进程已训练结束, 这是它的最后一次同步
+};
 
-      // b: 层次化softmax/negative sampling
-      if (cw) {
+/*
+ * 在套接字上完整地发送/接收n个字节.
+ */
+void SendAll(int fd, void *buf, long long n) {
+  char *p = (char *)buf;
+  ssize_t r;
+
+  while (n > 0) {
+    r = write(fd, p, n);
+    if (r <= 0) {
+      printf("ERROR: sync write failed\n");
+      exit(1);
+    }
+    p += r;
+    n -= r;
+  }
+}
 
-        // 使用除以窗口长度. neu1 = ∑ syn0/cw  
-        for (c = 0; c < layer1_size; c++) 
-            neu1[c] /= cw;
+void RecvAll(int fd, void *buf, long long n) {
+  char *p = (char *)buf;
+  ssize_t r;
 
-        // b.1: 是否使用hs.（Hierarchical Softmax）
-        if (hs) {
-
-            // a.当前word的huffman编码长度, 沿着huffman编码路径向下行走.
-            //      一次计算当前一个的中间节点
-            for (d = 0; d < vocab[word].codelen; d++) {
-              f = 0;
-
-              // a.1: l2: 当前节点号 * 隐单元数，用于索引syn1权重.
-              // 
-              // 关于l2的最大值：
-              //    假设该二叉树的每个中间节点，都有一个叶子节点
-              //    此时它的最大中间数目为(vocab_size-1). 
-              //    也就是说，huffman的最长编码为: (vocab_size-1)
-              //
-              // 因此，我们可知syn1的size: vocab_size x layer1_size
-              // 是很合理的.
-              // 每个节点，都对应着关于layer1_size的向量
-              l2 = vocab[word].point[d] * layer1_size;
-              
-              // a.2: 前向传播: 计算f值，即前元隐单元和参数sync1的sum.
-              //        1.(syn1刚开始全0) 
-              //        2.f = ∑ neu1*sync1
-              //
-              // Propagate hidden -> output
-              for (c = 0; c < layer1_size; c++) {
-                  f += neu1[c] * syn1[c + l2];
-              }
+  while (n > 0) {
+    r = read(fd, p, n);
+    if (r <= 0) {
+      printf("ERROR: sync read failed\n");
+      exit(1);
+    }
+    p += r;
+    n -= r;
+  }
+}
 
-              // a.3: 再由f值作logistic regression计算，得到一个概率值f
-              //    input:f (-6, 6) => logistic unit => output: f (0,1)
-              //
-              //    将 expTable的定义，与下式同时代入，可化简得到：
-              //        expTable: 等于1/(1+e^-x)，即logistic函数
-              //
-              //    根据f=∑wx, 查expTable表(预先计算好的整数位e指数)，相当于做logistic运算.
-              //    输入范围: (-MAX_EXP, MAX_EXP), 即(-6, 6)之间. 
-              if (f <= -MAX_EXP) 
-                  continue;
-              else if (f >= MAX_EXP) 
-                  continue;
-              else 
-                  f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
-
-              // a.4: lr预测的f值(为1的概率), 与真实编码的反面的差. 即梯度 
-              //    和该节点上真实编码位比较
-              //    该公式可以由推导得到.
-              // 'g' is the gradient multiplied by the learning rate
-              g = (1 - vocab[word].code[d] - f) * alpha;
-             
-              // a.5: 反向传播: 利用当前节点所计算g和syn1，更新对应的:neu1e
-              //    neu1e = ∑ g*syn1        (neu1e初始值全0, 不断更新)
-              //
-              // Propagate errors output -> hidden
-              for (c = 0; c < layer1_size; c++) {
-                  neu1e[c] += g * syn1[c + l2];
-              }
-              
-              // a.6: 利用当前节点所计算的g和neu1, 更新syn1
-              //    syn1 = ∑ g*neu1         (syn1初始值全0,不断更新)
-              // Learn weights hidden -> output
-              for (c = 0; c < layer1_size; c++) {
-                  syn1[c + l2] += g * neu1[c];
-              }
-            }
-        }
+/*
+ * 需要同步的矩阵及其行的stamp: syn0, 以及hs时的syn1, negative > 0时的syn1neg. 返回矩阵个数.
+ */
+int SyncMatrices(real **m, unsigned int **stamp) {
+  int n = 0;
+  m[n] = syn0;
+  stamp[n++] = syn0_stamp;
+  if (hs) {
+    m[n] = syn1;
+    stamp[n++] = syn1_stamp;
+  }
+  if (negative > 0) {
+    m[n] = syn1neg;
+    stamp[n++] = syn1neg_stamp;
+  }
+  return n;
+}
 
-        // b.2: NEGATIVE SAMPLING,
-        // negative为采样的数目.
-        if (negative > 0) { 
+/*
+ * 同步用的缓冲区: 每个矩阵一份行号列表, 以及最多所有行的增量.
+ */
+void AllocSyncBuffers(int k) {
+  long long a;
+  dist_rows = (int *)malloc(k * vocab_size * sizeof(int));
+  dist_union = (int *)malloc(k * vocab_size * sizeof(int));
+  dist_pos = (int *)malloc(vocab_size * sizeof(int));
+  for (a = 0; a < vocab_size; a++) dist_pos[a] = -1;
+  a = posix_memalign((void **)&dist_delta, 128, k * vocab_size * layer1_size * sizeof(real));
+  if (dist_delta == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  a = posix_memalign((void **)&dist_mean, 128, k * vocab_size * layer1_size * sizeof(real));
+  if (dist_mean == NULL) {printf("Memory allocation failed\n"); exit(1);}
+}
 
-            // 1个label=1的样本：       (word->word自身)
-            // negative个label=0的样本: (word->非word本身的其它词)
-            //
-            // 原理：使用logistic regression来实现softmax
-            for (d = 0; d < negative + 1; d++) {
-              
-              // 1.
-              // 如果d=0, 初始化target/label
-              // 如果d>0, 从词表中随机取一个词(非原词). label=0
-              if (d == 0) {
-                target = word;
-                label = 1;
-              } else {
-                next_random = next_random * (unsigned long long)25214903917 + 11;
-                target = table[(next_random >> 16) % table_size];
-                
-                if (target == 0) 
-                    target = next_random % (vocab_size - 1) + 1;
-                
-                if (target == word) 
-                    continue;
-                
-                label = 0;
-              }
+/*
+ * 协调进程: fork出num_workers个工作进程, 每个工作进程与协调进程之间有一对Unix套接字.
+ * 工作进程继承了词汇表、Huffman树、unigram表和初始化后的矩阵, 所以初始模型完全相同;
+ * 工作进程w训练第w份语料(由它的各训练线程再均分), 学习率按自己的那份语料衰减.
+ * 工作进程中函数返回, 继续训练; 协调进程中函数返回后调用RunCoordinator().
+ */
+void StartWorkers() {
+  long long a, w;
+  int sv[2];
 
-              // 该target对应的位置
-              l2 = target * layer1_size;
-              f = 0;
-              
-              // 2. 目标：由词word，预测成target的概率
-              // f = ∑ neu1 * syn1neg
-              for (c = 0; c < layer1_size; c++) 
-                  f += neu1[c] * syn1neg[c + l2];
+  dist_fds = (int *)malloc(num_workers * sizeof(int));
+  dist_pids = (pid_t *)malloc(num_workers * sizeof(pid_t));
+  fflush(stdout);
+  for (w = 0; w < num_workers; w++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+      printf("ERROR: socketpair failed\n");
+      exit(1);
+    }
+    dist_pids[w] = fork();
+    if (dist_pids[w] < 0) {
+      printf("ERROR: fork failed\n");
+      exit(1);
+    }
+    if (dist_pids[w] == 0) {
+      // 工作进程: 关闭与其它工作进程的连接.
+      for (a = 0; a < w; a++) close(dist_fds[a]);
+      close(sv[0]);
+      dist_fd = sv[1];
+      worker_id = w;
+      train_words = train_words / num_workers + 1;
+      stats_file[0] = 0;
+      checkpoint_file[0] = 0;
+      eval_interval = 0;
+      if (w > 0) debug_mode = 0;
+
+      // base: 上一次同步后的全局模型.
+      dist_k = SyncMatrices(dist_mats, dist_stamps);
+      dist_size = dist_k * vocab_size * layer1_size;
+      a = posix_memalign((void **)&dist_base, 128, dist_size * sizeof(real));
+      if (dist_base == NULL) {printf("Memory allocation failed\n"); exit(1);}
+      for (a = 0; a < dist_k; a++) 
+          memcpy(dist_base + a * vocab_size * layer1_size, dist_mats[a], vocab_size * layer1_size * sizeof(real));
+      AllocSyncBuffers(dist_k);
+      dist_since = dirty_epoch;
+      return;
+    }
+    close(sv[1]);
+    dist_fds[w] = sv[0];
+  }
+}
 
-              // 3. 计算logistic的概率, 并使用该g进行更新
-              if (f > MAX_EXP) 
-                  g = (label - 1) * alpha;
-              else if (f < -MAX_EXP) 
-                  g = (label - 0) * alpha;
-              else 
-                  g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+/*
+ * 工作进程: 与协调进程同步一次. 与训练线程并发执行, 不暂停训练:
+ *    1. 发送上次同步后被更新过的行的增量delta = 当前模型 - base;
+ *    2. 接收所有工作进程发来的行的并集, 及其平均增量mean;
+ *    3. 对并集中的行: 当前模型 += mean - delta(本进程没有发送的行delta为0), base += mean.
+ * 第3步保留了第1步之后训练线程继续做的更新, 这些行的stamp已是新的epoch, 下次同步时发送.
+ * 只发送被更新过的行, 通信量与这段时间的工作集成正比, 而不是词汇表大小.
+ * done为1时为最后一次同步.
+ */
+void SyncWorker(int done) {
+  long long a, b, c, i, l, r, off = 0, total = 0, sent[3];
+  unsigned int since = dist_since;
+  struct sync_header h;
+  real *d;
+
+  // 1. 列出被更新过的行, 打包增量.
+  dist_since = DirtyAdvance();
+  for (a = 0; a < dist_k; a++) {
+    sent[a] = h.n[a] = DirtyRows(dist_stamps[a], since > 1 ? since - 1 : since, dist_rows + a * vocab_size);
+    PackRows(dist_mats[a], dist_base + a * vocab_size * layer1_size, dist_rows + a * vocab_size, h.n[a], dist_delta + off);
+    off += h.n[a] * layer1_size;
+  }
+  h.words = WordsRead();
+  h.done = done;
+  SendAll(dist_fd, &h, sizeof(h));
+  for (a = 0; a < dist_k; a++) SendAll(dist_fd, dist_rows + a * vocab_size, h.n[a] * sizeof(int));
+  SendAll(dist_fd, dist_delta, off * sizeof(real));
+
+  // 2. 接收并集中的行及平均增量.
+  RecvAll(dist_fd, &h, sizeof(h));
+  for (a = 0; a < dist_k; a++) {
+    RecvAll(dist_fd, dist_union + a * vocab_size, h.n[a] * sizeof(int));
+    total += h.n[a];
+  }
+  RecvAll(dist_fd, dist_mean, total * layer1_size * sizeof(real));
+
+  // 3. 应用. dist_pos[row]为本进程发送的该行增量在本矩阵增量中的序号.
+  off = 0;
+  d = dist_delta;
+  for (a = 0; a < dist_k; a++) {
+    for (i = 0; i < sent[a]; i++) dist_pos[dist_rows[a * vocab_size + i]] = i;
+    for (i = 0; i < h.n[a]; i++, off += layer1_size) {
+      r = dist_union[a * vocab_size + i];
+      l = r * layer1_size;
+      b = dist_pos[r];
+      for (c = 0; c < layer1_size; c++) {
+        dist_mats[a][l + c] += dist_mean[off + c] - (b >= 0 ? d[b * layer1_size + c] : 0);
+        dist_base[a * vocab_size * layer1_size + l + c] += dist_mean[off + c];
+      }
+    }
+    for (i = 0; i < sent[a]; i++) dist_pos[dist_rows[a * vocab_size + i]] = -1;
+    d += sent[a] * layer1_size;
+  }
+}
 
-              // 4.使用g 更新neu1e
-              for (c = 0; c < layer1_size; c++) 
-                  neu1e[c] += g * syn1neg[c + l2];
-              
-              // 5.使用g 更新syn1neg
-              for (c = 0; c < layer1_size; c++) 
-                  syn1neg[c + l2] += g * neu1[c];
-            }
-        }
+/*
+ * 工作进程的同步线程: 本进程每读取sync_words个词同步一次.
+ */
+void *SyncThread(void *arg) {
+  long long next = sync_words;
+  struct timespec ts = {0, 10000000};
+
+  while (!__atomic_load_n(&stats_stop, __ATOMIC_ACQUIRE)) {
+    nanosleep(&ts, NULL);
+    if (WordsRead() < next) continue;
+    next += sync_words;
+    SyncWorker(0);
+  }
+  pthread_exit(NULL);
+}
 
-        // b.3: 反向传播, 根据当前窗口的上下文，利用neu1e，更新syn0
-        // hidden -> in
-        for (a = b; a < window * 2 + 1 - b; a++) {
-          if (a != window) {
-              c = sentence_position - window + a;
-              
-              // a.范围判断
-              if (c < 0) continue;
-              if (c >= sentence_length) continue;
+/*
+ * 工作进程: 训练结束后做最后一次同步, 然后退出. 结果由协调进程保存.
+ */
+void FinishWorker() {
+  SyncWorker(1);
+  close(dist_fd);
+  exit(0);
+}
 
-              // b.获取窗口当前词对应索引，用于检索对应的syn0.
-              last_word = sen[c];
-              if (last_word == -1) continue;
+/*
+ * 协调进程: 按轮同步. 每一轮从每个未结束的工作进程接收它被更新过的行的增量, 按行累加;
+ * 对所有工作进程发来的行的并集求平均(除以本轮参与的工作进程数, 没有发送某行的进程增量为0),
+ * 发回, 并累加到自己的模型(即全局模型)上. 工作进程的最后一次同步之后不再等待它.
+ * 所有工作进程都结束后, syn0/syn1/syn1neg即为最终的模型.
+ */
+void RunCoordinator() {
+  long long a, c, i, l, r, w, n = vocab_size * layer1_size, rounds = 0, active = num_workers, count, words, off, total;
+  long long *worker_words = (long long *)calloc(num_workers, sizeof(long long)), un[3];
+  int *done = (int *)calloc(num_workers, sizeof(int));
+  double t, sync_time = 0, bytes = 0, dense_bytes = 0;
+  char *touched;
+  struct sync_header h, reply;
+  real *sum = NULL;
+  FILE *fo = NULL;
+
+  dist_k = SyncMatrices(dist_mats, dist_stamps);
+  dist_size = dist_k * n;
+  AllocSyncBuffers(dist_k);
+  a = posix_memalign((void **)&sum, 128, dist_size * sizeof(real));
+  if (sum == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < dist_size; a++) sum[a] = 0;
+  touched = (char *)calloc(dist_k * vocab_size, 1);
+  if (stats_file[0] != 0) {
+    fo = fopen(stats_file, "wb");
+    if (fo == NULL) {
+      printf("ERROR: cannot open stats file %s\n", stats_file);
+      exit(1);
+    }
+  }
 
-              // c.更新窗口当前词所影响的syn0权重.
-              for (c = 0; c < layer1_size; c++) 
-                  syn0[c + last_word * layer1_size] += neu1e[c];
-              
-          }
-        }
+  while (active > 0) {
+    // 1. 接收各工作进程的行增量, 按行累加, 并记录行的并集. 接收过程中等待最慢的工作进程到达同步点.
+    for (a = 0; a < dist_k; a++) un[a] = 0;
+    count = 0;
+    t = 0;
+    for (w = 0; w < num_workers; w++) {
+      if (done[w]) continue;
+      RecvAll(dist_fds[w], &h, sizeof(h));
+      if (count == 0) t = WallTime();
+      for (a = 0, total = 0; a < dist_k; a++) {
+        RecvAll(dist_fds[w], dist_rows + a * vocab_size, h.n[a] * sizeof(int));
+        total += h.n[a];
       }
-    } else {  //train skip-gram
-      for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
-        c = sentence_position - window + a;
-        if (c < 0) continue;
-        if (c >= sentence_length) continue;
-        last_word = sen[c];
-        if (last_word == -1) continue;
-        l1 = last_word * layer1_size;
-        for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-        // HIERARCHICAL SOFTMAX
-        if (hs) for (d = 0; d < vocab[word].codelen; d++) {
-          f = 0;
-          l2 = vocab[word].point[d] * layer1_size;
-          // Propagate hidden -> output
-          for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1[c + l2];
-          if (f <= -MAX_EXP) continue;
-          else if (f >= MAX_EXP) continue;
-          else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
-          // 'g' is the gradient multiplied by the learning rate
-          g = (1 - vocab[word].code[d] - f) * alpha;
-          // Propagate errors output -> hidden
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1[c + l2];
-          // Learn weights hidden -> output
-          for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * syn0[c + l1];
-        }
-        // NEGATIVE SAMPLING
-        if (negative > 0) for (d = 0; d < negative + 1; d++) {
-          if (d == 0) {
-            target = word;
-            label = 1;
-          } else {
-            next_random = next_random * (unsigned long long)25214903917 + 11;
-            target = table[(next_random >> 16) % table_size];
-            if (target == 0) target = next_random % (vocab_size - 1) + 1;
-            if (target == word) continue;
-            label = 0;
+      RecvAll(dist_fds[w], dist_delta, total * layer1_size * sizeof(real));
+      bytes += sizeof(h) + total * (sizeof(int) + layer1_size * sizeof(real));
+      for (a = 0, off = 0; a < dist_k; a++) 
+          for (i = 0; i < h.n[a]; i++, off += layer1_size) {
+            r = dist_rows[a * vocab_size + i];
+            if (!touched[a * vocab_size + r]) {
+              touched[a * vocab_size + r] = 1;
+              dist_union[a * vocab_size + un[a]++] = r;
+            }
+            l = a * n + r * layer1_size;
+            for (c = 0; c < layer1_size; c++) sum[l + c] += dist_delta[off + c];
           }
-          l2 = target * layer1_size;
-          f = 0;
-          for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1neg[c + l2];
-          if (f > MAX_EXP) g = (label - 1) * alpha;
-          else if (f < -MAX_EXP) g = (label - 0) * alpha;
-          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
-          for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * syn0[c + l1];
+      worker_words[w] = h.words;
+      if (h.done) done[w] = 2;
+      count++;
+    }
+
+    // 2. 求平均并打包, 发回, 更新全局模型, 清零累加区.
+    for (a = 0, off = 0; a < dist_k; a++) {
+      reply.n[a] = un[a];
+      for (i = 0; i < un[a]; i++, off += layer1_size) {
+        l = a * n + (long long)dist_union[a * vocab_size + i] * layer1_size;
+        for (c = 0; c < layer1_size; c++) {
+          dist_mean[off + c] = sum[l + c] / count;
+          dist_mats[a][l - a * n + c] += dist_mean[off + c];
+          sum[l + c] = 0;
         }
-        // Learn weights input -> hidden
-        for (c = 0; c < layer1_size; c++) syn0[c + l1] += neu1e[c];
+        touched[a * vocab_size + dist_union[a * vocab_size + i]] = 0;
       }
     }
-    
-    // step 3-6: 移动当前句子(1000个词)中的当前词汇指针: 移动一格.
-    sentence_position++;
-    if (sentence_position >= sentence_length) {
-      sentence_length = 0;
-      continue;
+    reply.words = 0;
+    reply.done = 0;
+    for (w = 0; w < num_workers; w++) {
+      if (done[w] == 1) continue;
+      SendAll(dist_fds[w], &reply, sizeof(reply));
+      for (a = 0; a < dist_k; a++) SendAll(dist_fds[w], dist_union + a * vocab_size, un[a] * sizeof(int));
+      SendAll(dist_fds[w], dist_mean, off * sizeof(real));
+      bytes += sizeof(reply) + off / layer1_size * sizeof(int) + off * sizeof(real);
+    }
+    dense_bytes += 2 * count * dist_size * sizeof(real);
+    for (w = 0; w < num_workers; w++) 
+        if (done[w] == 2) {
+          done[w] = 1;
+          close(dist_fds[w]);
+          active--;
+        }
+    t = WallTime() - t;
+    sync_time += t;
+    rounds++;
+
+    for (words = 0, w = 0; w < num_workers; w++) words += worker_words[w];
+    dist_words = words;
+    if (debug_mode > 1) {
+      printf("%cSync round %lld: %lld workers, %lld rows, Progress: %.2f%%  Words/sec: %.2fk  ", 13, rounds, count, off / layer1_size,
+             words / (real)(iter * train_words + 1) * 100, words / ((WallTime() - start + 1e-6) * 1000));
+      fflush(stdout);
+    }
+    if (fo != NULL) {
+      fprintf(fo, "{\"sync\": {\"round\": %lld, \"time\": %.3f, \"workers\": %lld, \"words\": %lld, \"rows\": %lld, \"sync_sec\": %.4f}}\n",
+              rounds, WallTime() - start, count, words, off / layer1_size, t);
+      fflush(fo);
     }
   }
 
-  // 
-  fclose(fi);
-  free(neu1);
-  free(neu1e);
+  for (w = 0; w < num_workers; w++) waitpid(dist_pids[w], NULL, 0);
+  if (debug_mode > 0) 
+      printf("\nDistributed: %d workers x %d threads, %lld sync rounds, %.3fs in sync, %.1f MB sent (%.1f%% of dense averaging)\n",
+             num_workers, num_threads, rounds, sync_time, bytes / 1048576, bytes * 100 / (dense_bytes + 1));
+  if (fo != NULL) fclose(fo);
+  free(sum);
+  free(touched);
+  free(done);
+  free(worker_words);
+  free(dist_fds);
+  free(dist_pids);
+}
+
+/*
+ * 向checkpoint_file追加一个增量checkpoint: 读取的词数, 然后对每个同步矩阵(编号0: syn0,
+ * 1: syn1, 2: syn1neg)写入since之后被更新过的行(见WriteRows()), 最后以编号-1结束.
+ * 第一个checkpoint(since为0)包含所有行; 依次用各checkpoint的行覆盖, 即得到最后一个checkpoint时的模型.
+ */
+void WriteCheckpoint(FILE *fo, unsigned int since, int *rows, real *buf) {
+  long long n, words = WordsRead();
+  int id = -1;
+
+  fwrite(&words, sizeof(long long), 1, fo);
+  n = DirtyRows(syn0_stamp, since, rows);
+  WriteRows(fo, 0, syn0, rows, n, buf);
+  if (hs) {
+    n = DirtyRows(syn1_stamp, since, rows);
+    WriteRows(fo, 1, syn1, rows, n, buf);
+  }
+  if (negative > 0) {
+    n = DirtyRows(syn1neg_stamp, since, rows);
+    WriteRows(fo, 2, syn1neg, rows, n, buf);
+  }
+  fwrite(&id, sizeof(int), 1, fo);
+  fflush(fo);
+}
+
+/*
+ * checkpoint线程: 每读取checkpoint_words个词写一个增量checkpoint, 只包含上次之后被更新过的行,
+ * 文件大小与这段时间的工作集成正比. 文件头为"W2VCKPT1", vocab_size, layer1_size.
+ */
+void *CheckpointThread(void *arg) {
+  long long next = checkpoint_words, header[2] = {vocab_size, layer1_size};
+  unsigned int since = 0, prev;
+  int *rows = (int *)malloc(vocab_size * sizeof(int));
+  real *buf = (real *)malloc(vocab_size * layer1_size * sizeof(real));
+  struct timespec ts = {0, 10000000};
+  FILE *fo = fopen(checkpoint_file, "wb");
+
+  if (fo == NULL) {
+    printf("ERROR: cannot open checkpoint file %s\n", checkpoint_file);
+    exit(1);
+  }
+  fwrite("W2VCKPT1", 1, 8, fo);
+  fwrite(header, sizeof(long long), 2, fo);
+  while (!__atomic_load_n(&stats_stop, __ATOMIC_ACQUIRE)) {
+    nanosleep(&ts, NULL);
+    if (WordsRead() < next) continue;
+    next += checkpoint_words;
+    prev = since;
+    since = DirtyAdvance();
+    WriteCheckpoint(fo, prev > 1 ? prev - 1 : prev, rows, buf);
+  }
+  WriteCheckpoint(fo, since > 1 ? since - 1 : since, rows, buf);
+  fclose(fo);
+  free(rows);
+  free(buf);
   pthread_exit(NULL);
 }
 
+/*
+ * 多线程训练: 启动训练线程, 以及读取线程、统计线程、监控线程和(分布式工作进程的)同步线程, 等待训练结束.
+ */
+void TrainThreads() {
+  long a;
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t)), *rt = NULL, st, mt, syt, ckt;
+  double train_sec;
+
+  // syn1neg热点行合并时的分区锁.
+  if (neg_partitions > 0) {
+    if (hot_rows > vocab_size) hot_rows = vocab_size;
+    neg_locks = (pthread_mutex_t *)malloc(neg_partitions * sizeof(pthread_mutex_t));
+    for (a = 0; a < neg_partitions; a++) pthread_mutex_init(&neg_locks[a], NULL);
+  }
+  if (replicate_rows > vocab_size) replicate_rows = vocab_size;
+  if (bf16_storage) InitBf16Storage();
+
+  // 每个训练线程的统计计数器, 以及定期输出统计信息的线程和定期评测的监控线程.
+  stats = (struct thread_stats *)calloc(num_threads, sizeof(struct thread_stats));
+  turn_active = (char *)malloc(num_threads);
+  memset(turn_active, 1, num_threads);
+  if (stats_file[0] != 0) {
+    stats_fo = fopen(stats_file, "wb");
+    if (stats_fo == NULL) {
+      printf("ERROR: cannot open stats file %s\n", stats_file);
+      exit(1);
+    }
+    pthread_create(&st, NULL, StatsThread, NULL);
+  }
+  if (eval_interval > 0) pthread_create(&mt, NULL, MonitorThread, NULL);
+  if (dist_fd >= 0) pthread_create(&syt, NULL, SyncThread, NULL);
+  if (checkpoint_file[0] != 0) pthread_create(&ckt, NULL, CheckpointThread, NULL);
+
+  // 多线程训练：读取整个文件，进行神经网络模型训练.
+  // 流水线模式: num_readers个读取线程为训练线程准备句子.
+  // 本进程的训练时间(从启动训练线程到全部结束), 用于WriteMonitorSummary(). TrainModel()的phases.train
+  // 在本函数返回后才赋值, 还包括分布式模式下协调进程的时间.
+  train_sec = WallTime();
+  if (num_readers > 0) {
+    a = posix_memalign((void **)&queues, 128, num_threads * sizeof(struct sentence_queue));
+    if (queues == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    memset(queues, 0, num_threads * sizeof(struct sentence_queue));
+    rt = (pthread_t *)malloc(num_readers * sizeof(pthread_t));
+    for (a = 0; a < num_readers; a++) 
+        pthread_create(&rt[a], NULL, ReaderThread, (void *)a);
+  }
+  for (a = 0; a < num_threads; a++) 
+      pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
+  for (a = 0; a < num_threads; a++) 
+      pthread_join(pt[a], NULL);
+  train_sec = WallTime() - train_sec;
+  if (bf16_storage) FinishBf16Storage();
+  if (stop_training && debug_mode > 0) 
+      printf("\nStopped early after %.2f of %lld epochs\n", WordsRead() / (double)(train_words + 1), iter);
+
+  // 确定性模式: 打印各矩阵的校验和, 相同线程数下两次运行的结果应完全相同.
+  if (deterministic) 
+      printf("\nChecksums: syn0 %016llx syn1 %016llx syn1neg %016llx\n",
+             Checksum(syn0, vocab_size * layer1_size), Checksum(hs ? syn1 : NULL, vocab_size * layer1_size),
+             Checksum(negative > 0 ? syn1neg : NULL, vocab_size * layer1_size));
+  __atomic_store_n(&stats_stop, 1, __ATOMIC_RELEASE);
+  if (dist_fd >= 0) pthread_join(syt, NULL);
+  if (checkpoint_file[0] != 0) pthread_join(ckt, NULL);
+  if (eval_interval > 0) {
+    pthread_join(mt, NULL);
+    WriteMonitorSummary(train_sec);
+  }
+  if (stats_file[0] != 0) {
+    pthread_join(st, NULL);
+    fclose(stats_fo);
+    stats_fo = NULL;
+  }
+  if (num_readers > 0) {
+    for (a = 0; a < num_readers; a++) 
+        pthread_join(rt[a], NULL);
+
+    // 打印流水线统计: 训练线程等待读取线程的时间越少越好.
+    if (debug_mode > 1) {
+      printf("\nPipeline: %d readers, %d compute threads\n", num_readers, num_threads);
+      for (a = 0; a < num_threads; a++) 
+          printf("  thread %ld: waited %.3fs for input, reader waited %.3fs for space\n", a, queues[a].empty_wait, queues[a].full_wait);
+    }
+    free(rt);
+    free(queues);
+  }
+  free(pt);
+}
+
 /*
  * 训练模型.
  */
 void TrainModel() {
   long a, b, c, d;
   FILE *fo;
+  double t = WallTime();
 
-  // a. 使用多少线程.
-  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  InitCorpusFiles();
   printf("Starting training using file %s\n", train_file);
+  if (num_corpus_files > 1) printf("Corpus: %d files, %lld bytes\n", num_corpus_files, file_size);
   
   // b. 学习率: default: skip-gram=0.025; CBOW = 0.05
   starting_alpha = alpha;
 
   // b. 如果设置了词汇表，使用自定义词汇表；
   //    否则，使用语料库中生成的词汇表； 
-  if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
+  //    设置了短语阈值时, 先检测短语, 之后读取语料时合并短语.
+  if (phrase_threshold > 0) {
+    phases.phrase = WallTime();
+    LearnPhrases();
+    phases.phrase = WallTime() - phases.phrase;
+  }
+  //    设置了词汇表缓存时, 缓存有效则直接读取, 否则统计后保存.
+  if (read_vocab_file[0] != 0) ReadVocab();
+  else if (vocab_cache_file[0] == 0 || !LoadVocabCache()) {
+    LearnVocabFromTrainFile();
+    vocab_cache_save = (vocab_cache_file[0] != 0);
+  }
   
+  // 统计词表时的下标(vocab_hash等)是64位的, 但训练使用的行号(unigram表table、Huffman路径point、
+  // 子词的subword_rows、DirtyRows()的行号)是int: 词数(加上子词的bucket数)不能超过2^31 - 1.
+  if (vocab_size + subword_buckets > MAX_VOCAB_ROWS) {
+    printf("ERROR: %lld words (plus %lld subword buckets) exceed the limit of %lld embedding rows; raise -min-count or lower -subword-buckets\n",
+           vocab_size, subword_buckets, MAX_VOCAB_ROWS);
+    exit(1);
+  }
+
   // c. 是否保存词汇表
   if (save_vocab_file[0] != 0) SaveVocab();
 
+  // c2. 预计算subsampling保留阈值.
+  if (sample > 0) InitKeepThreshold();
+  phases.vocab = WallTime() - t;
+
   // 必须设置输出文件.
-  if (output_file[0] == 0) return;
+  if (output_file[0] == 0) {
+    if (vocab_cache_save) SaveVocabCache(0);
+    WritePhases();
+    return;
+  }
 
   // d. 初始化神经网络参数.
+  t = WallTime();
   InitNet();
+  if (num_workers > 1 || checkpoint_file[0] != 0) InitDirtyTracking();
+  phases.init_net = WallTime() - t;
 
   // e.初始化unigram表.
-  if (negative > 0) InitUnigramTable();
-
-  start = clock();
-
-  // f. 多线程训练：读取整个文件，进行神经网络模型训练.
-  for (a = 0; a < num_threads; a++) 
-      pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
-  for (a = 0; a < num_threads; a++) 
-      pthread_join(pt[a], NULL);
+  t = WallTime();
+  if (negative > 0 && !vocab_cache_table) InitUnigramTable();
+  phases.unigram = WallTime() - t;
+  if (vocab_cache_save) SaveVocabCache(1);
+
+  start = WallTime();
+
+  // f. 多线程训练. 分布式模式下, fork出的工作进程各自训练语料的一部分, 结束时与协调进程
+  //    做最后一次同步后退出; 本进程作为协调进程做参数平均, 最后保存平均后的模型.
+  if (num_workers > 1) {
+    StartWorkers();
+    if (dist_fd >= 0) {
+      TrainThreads();
+      FinishWorker();
+    }
+    RunCoordinator();
+  } else TrainThreads();
+  phases.train = WallTime() - start;
   
   // g. 结果输出.
+  t = WallTime();
+  if (subword_buckets > 0) {
+    if (save_subwords_file[0] != 0) SaveSubwords();
+    ComposeSubwordVectors();
+  }
   fo = fopen(output_file, "wb");
 
   // g1: 不使用分类，保存词向量embedding.
@@ -1250,6 +4617,11 @@ void TrainModel() {
 
   // close文件
   fclose(fo);
+  phases.save = WallTime() - t;
+
+  // h. 评测词向量.
+  if (eval_analogy_file[0] != 0 || eval_similarity_file[0] != 0) EvalModel();
+  WritePhases();
 }
 
 /*
@@ -1282,7 +4654,8 @@ int main(int argc, char **argv) {
     printf("Options:\n");
     printf("Parameters for training:\n");
     printf("\t-train <file>\n");
-    printf("\t\tUse text data from <file> to train the model\n");
+    printf("\t\tUse text data from <file> to train the model; <file> may be a comma-separated list of files,\n");
+    printf("\t\tdirectories or glob patterns, and @<list> reads one path per line from <list>\n");
     printf("\t-output <file>\n");
     printf("\t\tUse <file> to save the resulting word vectors / word clusters\n");
     printf("\t-size <int>\n");
@@ -1294,18 +4667,84 @@ int main(int argc, char **argv) {
     printf("\t\twill be randomly down-sampled; default is 1e-3, useful range is (0, 1e-5)\n");
     printf("\t-hs <int>\n");
     printf("\t\tUse Hierarchical Softmax; default is 0 (not used)\n");
+    printf("\t-prefetch <int>\n");
+    printf("\t\tPrefetch the next hierarchical-softmax row, the negative-sample rows and the next window's context row;\n");
+    printf("\t\tdefault is 1 (0 = off)\n");
+    printf("\t-hs-layout <int>\n");
+    printf("\t\tOrder of the Huffman inner nodes in memory: 0 = merge order (original), 1 = breadth-first,\n");
+    printf("\t\t2 = preorder along the more frequent child (default); only permutes syn1, results are unchanged\n");
     printf("\t-negative <int>\n");
     printf("\t\tNumber of negative examples; default is 5, common values are 3 - 10 (0 = not used)\n");
     printf("\t-threads <int>\n");
     printf("\t\tUse <int> threads (default 12)\n");
+    printf("\t-workers <int>\n");
+    printf("\t\tTrain in <int> worker processes on local sockets, each using -threads threads on its share of the corpus,\n");
+    printf("\t\tand average their parameters periodically; default is 0 (single process)\n");
+    printf("\t-sync-words <int>\n");
+    printf("\t\tWith -workers, average the parameters every <int> words read by each worker; default is 1000000\n");
+    printf("\t-checkpoint <file>\n");
+    printf("\t\tPeriodically append the rows of syn0/syn1/syn1neg updated since the previous checkpoint to <file>\n");
+    printf("\t\t(the first checkpoint holds all rows); not written with -workers\n");
+    printf("\t-checkpoint-words <int>\n");
+    printf("\t\tWrite a checkpoint every <int> words; default is 10000000\n");
+    printf("\t-readers <int>\n");
+    printf("\t\tUse <int> dedicated reader threads feeding the training threads through queues; default is 0\n");
+    printf("\t\t(each training thread reads its own input)\n");
+    printf("\t-neg-partitions <int>\n");
+    printf("\t\tPartition the rows of the negative-sampling output matrix into <int> lock-protected partitions and\n");
+    printf("\t\taccumulate the updates of the -hot-rows most frequent rows per thread, merging them after each sentence;\n");
+    printf("\t\tdefault is 0 (all rows are updated lock-free)\n");
+    printf("\t-hot-rows <int>\n");
+    printf("\t\tNumber of frequent rows accumulated per thread with -neg-partitions; default is 1024\n");
+    printf("\t-bf16 <int>\n");
+    printf("\t\tStore the input and negative-sampling output matrices as bfloat16 during training, with float\n");
+    printf("\t\tarithmetic and stochastic rounding on write-back; halves the model memory. Not combined with\n");
+    printf("\t\t-workers, -checkpoint, -eval-interval, -replicate-rows or -neg-partitions; default is 0 (float)\n");
+    printf("\t-replicate-rows <int>\n");
+    printf("\t\tKeep thread-private replicas of the input and negative-sampling output rows of the <int> most frequent\n");
+    printf("\t\twords and merge them into the shared matrices periodically; default is 0 (not used)\n");
+    printf("\t-replicate-words <int>\n");
+    printf("\t\tWith -replicate-rows, merge the replicas every <int> words read by each thread; default is 10000\n");
     printf("\t-iter <int>\n");
     printf("\t\tRun more training iterations (default 5)\n");
+    printf("\t-early-stop <float>\n");
+    printf("\t\tWhen the mean training loss of an epoch improves by less than <float> (relative) over the previous\n");
+    printf("\t\tepoch, decay alpha to zero over one final epoch and stop; default is 0 (always run -iter epochs)\n");
     printf("\t-min-count <int>\n");
     printf("\t\tThis will discard words that appear less than <int> times; default is 5\n");
+    printf("\t-subword-buckets <int>\n");
+    printf("\t\tfastText-style subwords: the input vector of a word is the mean of its own row and the rows of its\n");
+    printf("\t\tcharacter n-grams hashed into <int> buckets (2000000 is typical); default is 0 (not used)\n");
+    printf("\t-minn <int>\n");
+    printf("\t\tMinimum n-gram length in characters; default is 3\n");
+    printf("\t-maxn <int>\n");
+    printf("\t\tMaximum n-gram length in characters; default is 6\n");
+    printf("\t-save-subwords <file>\n");
+    printf("\t\tSave the n-gram bucket rows to <file> for out-of-vocabulary queries\n");
+    printf("\t-phrase-threshold <float>\n");
+    printf("\t\tDetect phrases first and merge each pair of adjacent words scoring above <float> into one token a_b\n");
+    printf("\t\twhile reading the corpus (word2phrase scoring; 100 is a typical value); default is 0 (not used)\n");
+    printf("\t-phrase-min-count <int>\n");
+    printf("\t\tIgnore phrases and phrase words that appear less than <int> times; default is 5\n");
+    printf("\t-phrase-max-bigrams <int>\n");
+    printf("\t\tKeep at most <int> bigram counts in memory, pruning the rarest; default is 20000000\n");
+    printf("\t-vocab-binary <int>\n");
+    printf("\t\tSave the vocabulary (-save-vocab) in a binary format that -read-vocab maps directly; -read-vocab\n");
+    printf("\t\tdetects the format; default is 0 (text, one word and count per line)\n");
+    printf("\t-vocab-cache <file>\n");
+    printf("\t\tCache the sorted vocabulary, Huffman codes and unigram table in <file>, keyed by a fingerprint of the\n");
+    printf("\t\tcorpus and -min-count; later runs on the same corpus map the cache instead of counting; ignored with -read-vocab\n");
+    printf("\t-count-sketch <int>\n");
+    printf("\t\tFirst count the corpus approximately in a count-min sketch of <int> MB per thread, then count exactly\n");
+    printf("\t\tonly the words that may reach -min-count; bounds vocabulary memory on huge corpora; default is 0 (not used)\n");
     printf("\t-alpha <float>\n");
     printf("\t\tSet the starting learning rate; default is 0.025 for skip-gram and 0.05 for CBOW\n");
     printf("\t-classes <int>\n");
     printf("\t\tOutput word classes rather than word vectors; default number of classes is 0 (vectors are written)\n");
+    printf("\t-stats-file <file>\n");
+    printf("\t\tWrite per-thread training counters and timers to <file> as one JSON object per line\n");
+    printf("\t-stats-interval <int>\n");
+    printf("\t\tWrite a stats line every <int> seconds; default is 10\n");
     printf("\t-debug <int>\n");
     printf("\t\tSet the debug mode (default = 2 = more info during training)\n");
     printf("\t-binary <int>\n");
@@ -1314,10 +4753,36 @@ int main(int argc, char **argv) {
     printf("\t\tThe vocabulary will be saved to <file>\n");
     printf("\t-read-vocab <file>\n");
     printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
+    printf("\t-deterministic <int>\n");
+    printf("\t\tTrain deterministically: threads process sentences in a fixed round-robin order, so the result\n");
+    printf("\t\tis bit-reproducible for a given number of threads, and checksums of the matrices are printed;\n");
+    printf("\t\tdefault is 0 (Hogwild)\n");
+    printf("\t-exp-table <int>\n");
+    printf("\t\tCompute the sigmoid with the legacy %d-entry lookup table instead of the polynomial approximation;\n", EXP_TABLE_SIZE);
+    printf("\t\tdefault is 0 (off)\n");
     printf("\t-cbow <int>\n");
     printf("\t\tUse the continuous bag of words model; default is 1 (use 0 for skip-gram model)\n");
+    printf("\nParameters for evaluation:\n");
+    printf("\t-eval-analogy <file>\n");
+    printf("\t\tAfter training, report the accuracy on the analogy questions (a b c d per line, ': section' headers) in <file>\n");
+    printf("\t-eval-similarity <file>\n");
+    printf("\t\tAfter training, report the Spearman correlation on the word pairs (w1 w2 score per line) in <file>\n");
+    printf("\t-eval-interval <int>\n");
+    printf("\t\tDuring training, evaluate a snapshot every <int> words (analogy subset, similarity, loss estimate)\n");
+    printf("\t\tin a monitor thread; default is 0 (off)\n");
+    printf("\t-eval-top <int>\n");
+    printf("\t\tSearch analogy answers among the <int> most frequent words only; default is 30000\n");
+    printf("\t-read-vectors <file>\n");
+    printf("\t\tDo not train; read the word vectors from <file> (format given by -binary) and evaluate them\n");
+    printf("\t-read-subwords <file>\n");
+    printf("\t\tWith -read-vectors, also read the n-gram buckets saved by -save-subwords\n");
+    printf("\t-query <file>\n");
+    printf("\t\tWith -read-vectors, write the vector of every word in <file> (one per line) as text to -output or stdout\n");
+    printf("\t\tinstead of evaluating; out-of-vocabulary words get the mean of their n-gram rows (needs -read-subwords)\n");
     printf("\nExamples:\n");
-    printf("./word2vec -train data.txt -output vec.txt -size 200 -window 5 -sample 1e-4 -negative 5 -hs 0 -binary 0 -cbow 1 -iter 3\n\n");
+    printf("./word2vec -train data.txt -output vec.txt -size 200 -window 5 -sample 1e-4 -negative 5 -hs 0 -binary 0 -cbow 1 -iter 3\n");
+    printf("./word2vec -read-vectors vec.bin -binary 1 -eval-analogy questions-words.txt -eval-similarity wordsim353.txt\n");
+    printf("./word2vec -read-vectors vec.bin -binary 1 -read-subwords sub.bin -query words.txt -output words.vec\n\n");
     return 0;
   }
 
@@ -1325,11 +4790,22 @@ int main(int argc, char **argv) {
   output_file[0] = 0;
   save_vocab_file[0] = 0;
   read_vocab_file[0] = 0;
+  stats_file[0] = 0;
+  eval_analogy_file[0] = 0;
+  eval_similarity_file[0] = 0;
+  read_vectors_file[0] = 0;
+  checkpoint_file[0] = 0;
+  vocab_cache_file[0] = 0;
+  save_subwords_file[0] = 0;
+  read_subwords_file[0] = 0;
+  query_file[0] = 0;
   if ((i = ArgPos((char *)"-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-stats-file", argc, argv)) > 0) strcpy(stats_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-stats-interval", argc, argv)) > 0) stats_interval = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-cbow", argc, argv)) > 0) cbow = atoi(argv[i + 1]);
   if (cbow) alpha = 0.05;
@@ -1340,24 +4816,92 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-hs", argc, argv)) > 0) hs = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-readers", argc, argv)) > 0) num_readers = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-workers", argc, argv)) > 0) num_workers = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sync-words", argc, argv)) > 0) sync_words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-checkpoint", argc, argv)) > 0) strcpy(checkpoint_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-checkpoint-words", argc, argv)) > 0) checkpoint_words = atoll(argv[i + 1]);
   if ((i = ArgPos((char *)"-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-neg-partitions", argc, argv)) > 0) neg_partitions = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hot-rows", argc, argv)) > 0) hot_rows = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-prefetch", argc, argv)) > 0) prefetch = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hs-layout", argc, argv)) > 0) hs_layout = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-bf16", argc, argv)) > 0) bf16_storage = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-replicate-rows", argc, argv)) > 0) replicate_rows = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-replicate-words", argc, argv)) > 0) replicate_words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-early-stop", argc, argv)) > 0) early_stop = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-count-sketch", argc, argv)) > 0) count_sketch = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab-cache", argc, argv)) > 0) strcpy(vocab_cache_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab-binary", argc, argv)) > 0) vocab_binary = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-phrase-threshold", argc, argv)) > 0) phrase_threshold = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-phrase-min-count", argc, argv)) > 0) phrase_min_count = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-phrase-max-bigrams", argc, argv)) > 0) phrase_max_bigrams = atoll(argv[i + 1]);
   if ((i = ArgPos((char *)"-classes", argc, argv)) > 0) classes = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-exp-table", argc, argv)) > 0) exp_table = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-deterministic", argc, argv)) > 0) deterministic = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-eval-analogy", argc, argv)) > 0) strcpy(eval_analogy_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-eval-similarity", argc, argv)) > 0) strcpy(eval_similarity_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-eval-top", argc, argv)) > 0) eval_top = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-eval-interval", argc, argv)) > 0) eval_interval = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-read-vectors", argc, argv)) > 0) strcpy(read_vectors_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-subword-buckets", argc, argv)) > 0) subword_buckets = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-minn", argc, argv)) > 0) subword_minn = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-maxn", argc, argv)) > 0) subword_maxn = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-subwords", argc, argv)) > 0) strcpy(save_subwords_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-read-subwords", argc, argv)) > 0) strcpy(read_subwords_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-query", argc, argv)) > 0) strcpy(query_file, argv[i + 1]);
   
+  if (num_readers > num_threads) num_readers = num_threads;
+  if (num_workers > 1 && deterministic) {
+    printf("ERROR: -deterministic cannot be combined with -workers\n");
+    return 1;
+  }
+  if (replicate_rows > 0 && neg_partitions > 0) {
+    printf("ERROR: -replicate-rows cannot be combined with -neg-partitions\n");
+    return 1;
+  }
+  if (vocab_cache_file[0] != 0 && phrase_threshold > 0) {
+    printf("ERROR: -vocab-cache cannot be combined with -phrase-threshold\n");
+    return 1;
+  }
+  if (subword_buckets > 0 && (subword_minn < 1 || subword_maxn < subword_minn)) {
+    printf("ERROR: -minn must be at least 1 and no larger than -maxn\n");
+    return 1;
+  }
+  if (subword_buckets > 0 && (bf16_storage || num_workers > 1 || checkpoint_file[0] != 0 || eval_interval > 0 || replicate_rows > 0)) {
+    printf("ERROR: -subword-buckets cannot be combined with -bf16, -workers, -checkpoint, -eval-interval or -replicate-rows\n");
+    return 1;
+  }
+  if (bf16_storage && (num_workers > 1 || checkpoint_file[0] != 0 || eval_interval > 0 || replicate_rows > 0 || neg_partitions > 0)) {
+    printf("ERROR: -bf16 cannot be combined with -workers, -checkpoint, -eval-interval, -replicate-rows or -neg-partitions\n");
+    return 1;
+  }
+
   // step 3: 分配空间.
   vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
-  vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
 
   // step 4: 分配logistic查表.
   expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
   
+  logSigTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
+  
   // 初始化: 预先计算好指数运算表. 
   for (i = 0; i < EXP_TABLE_SIZE; i++) {
     expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP); // Precompute the exp() table
     expTable[i] = expTable[i] / (expTable[i] + 1);                   // Precompute f(x) = x / (x + 1)
+    logSigTable[i] = -log(expTable[i]);                              // -log(sigmoid(x))
+  }
+
+  // step 5: 只评测(或查询)已有的词向量.
+  if (read_vectors_file[0] != 0) {
+    ReadVectors();
+    if (read_subwords_file[0] != 0) ReadSubwords();
+    if (query_file[0] != 0) QueryVectors(); else EvalModel();
+    return 0;
   }
 
-  // step 5: 训练模型.
+  // step 6: 训练模型.
   TrainModel();
   return 0;
 }
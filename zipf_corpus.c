@@ -0,0 +1,182 @@
+//--------------------------------------------------
+// 合成语料生成器: 词频服从Zipf分布, 用于可复现的性能测试.
+//
+// 同样的参数总是生成完全相同的语料(固定的线性同余随机数), 不依赖任何外部数据.
+//
+// 代码运行:
+//    gcc -O3 ./zipf_corpus.c -o zipf_corpus -lm
+//    ./zipf_corpus -output corpus.txt -words 10000000 -vocab 100000
+//
+// 第r个词(r从1开始)的概率 ∝ 1 / r^s. 词的拼写为r的26进制字母串,
+// 句子长度在[1, 2 * sentence - 1]上均匀分布, 每句一行.
+// -files k > 1时生成k个文件<output>.0 ... <output>.k-1, 每个文件的词数相同.
+//--------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_STRING 100
+
+char output_file[MAX_STRING];
+
+long long words = 10000000,       // 总词数
+     vocab_size = 100000,         // 词汇表大小
+     sentence = 20,               // 平均句子长度
+     files = 1,                   // 输出文件数
+     seed = 1;                    // 随机数种子
+
+double zipf_s = 1.0;              // Zipf分布的指数
+
+double *cdf;                      // 累积概率分布
+
+unsigned long long next_random;
+
+/*
+ * [0, 1)上均匀分布的随机数.
+ */
+double Uniform() {
+  next_random = next_random * (unsigned long long)25214903917 + 11;
+  next_random = next_random * (unsigned long long)6364136223846793005 + 1442695040888963407;
+  return (next_random >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * 计算Zipf分布的累积概率.
+ */
+void InitCdf() {
+  long long a;
+  double sum = 0;
+
+  cdf = (double *)malloc(vocab_size * sizeof(double));
+  for (a = 0; a < vocab_size; a++) {
+    sum += 1.0 / pow(a + 1, zipf_s);
+    cdf[a] = sum;
+  }
+  for (a = 0; a < vocab_size; a++) cdf[a] /= sum;
+}
+
+/*
+ * 按Zipf分布抽取一个词的序号(从0开始): 在cdf上二分查找.
+ */
+long long SampleWord() {
+  double u = Uniform();
+  long long lo = 0, hi = vocab_size - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * 第r个词的拼写: r的26进制字母串.
+ */
+void WordString(long long r, char *word) {
+  int a = 0, b;
+  char c;
+
+  r++;
+  while (r > 0) {
+    word[a++] = 'a' + (r - 1) % 26;
+    r = (r - 1) / 26;
+  }
+  word[a] = 0;
+  for (b = 0; b < a / 2; b++) {
+    c = word[b];
+    word[b] = word[a - 1 - b];
+    word[a - 1 - b] = c;
+  }
+}
+
+/*
+ * 生成n个词, 写入文件fo.
+ */
+void WriteCorpus(FILE *fo, long long n) {
+  long long a, len = 0;
+  char word[MAX_STRING];
+
+  for (a = 0; a < n; a++) {
+    if (len == 0) len = 1 + (long long)(Uniform() * (2 * sentence - 1));
+    WordString(SampleWord(), word);
+    fputs(word, fo);
+    len--;
+    fputc((len == 0 || a == n - 1) ? '\n' : ' ', fo);
+  }
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) {
+      if (!strcmp(str, argv[a])) {
+        if (a == argc - 1) {
+            printf("Argument missing for %s\n", str);
+            exit(1);
+        }
+        return a;
+      }
+  }
+
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  int i;
+  long long f;
+  char name[MAX_STRING + 32];
+  FILE *fo;
+
+  if (argc == 1) {
+    printf("Synthetic Zipfian corpus generator\n\n");
+    printf("Options:\n");
+    printf("\t-output <file>\n");
+    printf("\t\tWrite the corpus to <file> (or <file>.0 ... <file>.k-1 with -files k)\n");
+    printf("\t-words <int>\n");
+    printf("\t\tNumber of words to generate; default is 10000000\n");
+    printf("\t-vocab <int>\n");
+    printf("\t\tVocabulary size; default is 100000\n");
+    printf("\t-s <float>\n");
+    printf("\t\tZipf exponent; default is 1.0\n");
+    printf("\t-sentence <int>\n");
+    printf("\t\tAverage sentence length; default is 20\n");
+    printf("\t-files <int>\n");
+    printf("\t\tSplit the corpus into <int> files of equal word count; default is 1\n");
+    printf("\t-seed <int>\n");
+    printf("\t\tRandom seed; default is 1\n");
+    printf("\nExamples:\n");
+    printf("./zipf_corpus -output corpus.txt -words 10000000 -vocab 100000\n\n");
+    return 0;
+  }
+
+  output_file[0] = 0;
+  if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-words", argc, argv)) > 0) words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab", argc, argv)) > 0) vocab_size = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-s", argc, argv)) > 0) zipf_s = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sentence", argc, argv)) > 0) sentence = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-files", argc, argv)) > 0) files = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-seed", argc, argv)) > 0) seed = atoll(argv[i + 1]);
+  if (output_file[0] == 0 || vocab_size < 1 || sentence < 1 || files < 1) {
+    printf("ERROR: invalid arguments\n");
+    return 1;
+  }
+
+  next_random = seed;
+  InitCdf();
+
+  for (f = 0; f < files; f++) {
+    if (files == 1) strcpy(name, output_file); else sprintf(name, "%s.%lld", output_file, f);
+    fo = fopen(name, "wb");
+    if (fo == NULL) {
+      printf("ERROR: cannot open %s\n", name);
+      return 1;
+    }
+    WriteCorpus(fo, words / files + (f < words % files));
+    fclose(fo);
+  }
+
+  free(cdf);
+  return 0;
+}